@@ -0,0 +1,20 @@
+#include <Arduino.h>
+
+// HW mapping, shared with the host tests, include after settings.h (RELAYS_COUNT)
+#define PinMeter1 D5
+#define PinMeter2 D6
+#define PinRelay1 D2
+#define PinRelay2 D3
+#define PinButton1 D7
+#define PinButton2 D4
+#define PinLed1 D0
+#define PinLed2 D1
+#define PinLedStatus D8
+#define PinInterlockSwitch SD3 // GPIO10, free only in DIO flash mode (set in platformio.ini)
+#define PinInterlockAnalog A0
+
+// Pin arrays
+const uint8_t BUTTON_PINS[RELAYS_COUNT] = { PinButton1, PinButton2 };
+const uint8_t LED_PINS[RELAYS_COUNT] = { PinLed1, PinLed2 };
+const uint8_t RELAY_PINS[RELAYS_COUNT] = { PinRelay1, PinRelay2 }; // active LOW
+const uint8_t METER_PINS[RELAYS_COUNT] = { PinMeter1, PinMeter2 };
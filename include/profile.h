@@ -0,0 +1,39 @@
+#include <Arduino.h>
+
+// Build profile switches, override with build flags (e.g. -DFEATURE_WEB_UI=0), see platformio.ini environments
+
+// HTML pages: homepage, settings, calibration, toggle and restart
+#ifndef FEATURE_WEB_UI
+#define FEATURE_WEB_UI 1
+#endif
+
+// JSON API under /api
+#ifndef FEATURE_WEB_API
+#define FEATURE_WEB_API 1
+#endif
+
+// MQTT client, state updates, commands and reports
+#ifndef FEATURE_MQTT
+#define FEATURE_MQTT 1
+#endif
+
+// Logging to the serial console
+#ifndef FEATURE_LOGGING
+#define FEATURE_LOGGING 1
+#endif
+
+// Web server is needed by any of the web features
+#define FEATURE_WEB_SERVER (FEATURE_WEB_UI || FEATURE_WEB_API)
+
+#if FEATURE_LOGGING
+#define Log Serial
+#else
+// Swallows log output, the calls including their format strings are optimized away
+class NullLog {
+  public:
+    template<typename... Args> void print(Args...) {}
+    template<typename... Args> void println(Args...) {}
+    template<typename... Args> void printf(Args...) {}
+};
+static NullLog Log;
+#endif
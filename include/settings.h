@@ -2,9 +2,32 @@
 
 #define RELAYS_COUNT 2
 
+// Power saving modes used while no zone is active
+#define POWER_SAVE_NONE 0
+#define POWER_SAVE_MODEM 1
+#define POWER_SAVE_LIGHT 2
+
+// Number of frequency -> K-factor breakpoints stored per flow meter
+#define CALIBRATION_POINTS_COUNT 5
+
+struct CalibrationPoint {
+  float frequency; // pulse frequency in Hz
+  float factor;    // K-factor, pulses per second per L/min
+};
+
 struct RelayConfiguration {
   String name;
   int timeout;    
+  int pulseFilter; // minimum interval between flow meter pulses in microseconds, 0 disables
+
+  // Flow meter sampling, see FlowSmoothing and FlowTrigger in FlowMeter.h
+  int meterWindow;          // ms
+  int meterSmoothing;
+  int meterSmoothingFactor; // EWMA weight in % or number of averaged windows
+  int meterTrigger;
+  int meterThreshold;       // % of change reported by the change trigger
+  uint8_t calibrationPoints;
+  CalibrationPoint calibration[CALIBRATION_POINTS_COUNT];
 };
 
 struct Configuration {
@@ -14,5 +37,19 @@ struct Configuration {
   String mqtt_password;
   String mqtt_channel_prefix;
 
+  int power_save;
+
+  // Master valve / pump, relay number (starting with 1) or 0 when not used
+  int master_relay;
+  int master_lead; // ms between opening the master and the zone
+  int master_lag;  // s between closing the last zone and the master
+
+  // Rain / soil sensor blocking zone starts
+  int interlock_mode;         // see InterlockMode in Interlock.h
+  bool interlock_active_low;  // inhibit on low reading instead of high one
+  int interlock_threshold;    // ADC reading (0 - 1023) of analog sensors
+  int interlock_hysteresis;   // ADC counts the reading has to move back past the threshold to release
+  bool interlock_stop;        // stop running zones too, not just block new starts
+
   RelayConfiguration relays[RELAYS_COUNT];
 };
@@ -0,0 +1,13 @@
+# Writes section sizes of the firmware into the build directory after each build,
+# so flash/RAM usage of the build profiles (environments) can be compared.
+Import("env")
+
+def size_report(source, target, env):
+    firmware = str(source[0])
+    report = env.subst("$BUILD_DIR/size-report.txt")
+
+    print("Size report of %s written to %s" % (env.subst("$PIOENV"), report))
+    env.Execute('"$SIZETOOL" -A -d "%s" > "%s"' % (firmware, report))
+    env.Execute('"$SIZETOOL" -B -d "%s"' % firmware)
+
+env.AddPostAction("$BUILD_DIR/${PROGNAME}.elf", size_report)
@@ -0,0 +1,37 @@
+#include <Arduino.h>
+
+// Collects small writes (e.g. from serializeJson) into a fixed buffer and passes them
+// to the target (e.g. WiFiClient) in blocks, so nothing has to be built in a String first.
+template<size_t N>
+class BufferedPrint : public Print
+{
+    public:
+        BufferedPrint(Print &target) : _target(target) {}
+        ~BufferedPrint() { flush(); }
+
+        size_t write(uint8_t c) {
+            _buffer[_length++] = c;
+            if(_length == N) {
+                flush();
+            }
+            return 1;
+        }
+
+        size_t write(const uint8_t *buffer, size_t size) {
+            for(size_t i = 0; i < size; i++) {
+                write(buffer[i]);
+            }
+            return size;
+        }
+
+        void flush() {
+            if(_length > 0) {
+                _target.write(_buffer, _length);
+                _length = 0;
+            }
+        }
+    private:
+        Print &_target;
+        uint8_t _buffer[N];
+        size_t _length = 0;
+};
@@ -0,0 +1,96 @@
+#include "ButtonEvents.h"
+
+void ICACHE_RAM_ATTR ButtonEvents::push(uint8_t button, uint8_t level) {
+    if(button >= BUTTON_EVENTS_MAX_BUTTONS) {
+        return;
+    }
+
+    // Latest edge is kept apart from the queue, so the final level survives an overflow
+    _latest[button].button = button;
+    _latest[button].level = level;
+    _latest[button].time = micros();
+
+    uint8_t next = (_head + 1) & (BUTTON_EVENTS_QUEUE_SIZE - 1);
+
+    // Queue full, loop() is not keeping up
+    if(next == _tail) {
+        _dropped++;
+        _lost |= (1 << button);
+        return;
+    }
+
+    _queue[_head] = _latest[button];
+    _head = next;
+}
+
+// Takes the settled level of the button, returns true when it turned into a press
+bool ButtonEvents::settle(uint8_t button) {
+    _settling &= ~(1 << button);
+
+    bool pressed = (_level[button] == LOW);
+    if(pressed == _pressed[button]) {
+        return false;
+    }
+
+    _pressed[button] = pressed;
+    return pressed;
+}
+
+// Applies one edge, returns true when the level before it held long enough to make a press
+bool ButtonEvents::replay(const ButtonEdge &edge, uint32_t &time) {
+    // Previous level held for the debounce time before this edge
+    bool press = false;
+    time = _lastEdge[edge.button];
+    if((_settling & (1 << edge.button)) && (edge.time - _lastEdge[edge.button]) >= _debounceTime) {
+        press = settle(edge.button);
+    }
+
+    _level[edge.button] = edge.level;
+    _lastEdge[edge.button] = edge.time;
+    _settling |= (1 << edge.button);
+
+    return press;
+}
+
+bool ButtonEvents::nextPress(uint8_t &button, uint32_t &time) {
+    // Edges are replayed in order, so a press and release both queued while loop() was busy still count
+    while(_tail != _head) {
+        ButtonEdge edge = _queue[_tail];
+        _tail = (_tail + 1) & (BUTTON_EVENTS_QUEUE_SIZE - 1);
+
+        if(replay(edge, time)) {
+            button = edge.button;
+            return true;
+        }
+    }
+
+    // Edges dropped on overflow, only the last one matters as it carries the current level
+    for(uint8_t i = 0; _lost != 0 && i < BUTTON_EVENTS_MAX_BUTTONS; i++) {
+        if(!(_lost & (1 << i))) {
+            continue;
+        }
+
+        noInterrupts();
+        _lost &= ~(1 << i);
+        ButtonEdge edge = _latest[i];
+        interrupts();
+
+        // Already replayed when the latest edge still made it into the queue
+        if(edge.time != _lastEdge[i] && replay(edge, time)) {
+            button = i;
+            return true;
+        }
+    }
+
+    // Levels which stayed unchanged until now
+    uint32_t now = micros();
+    for(uint8_t i = 0; _settling != 0 && i < BUTTON_EVENTS_MAX_BUTTONS; i++) {
+        if((_settling & (1 << i)) && (now - _lastEdge[i]) >= _debounceTime && settle(i)) {
+            button = i;
+            time = _lastEdge[i];
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,45 @@
+#include <Arduino.h>
+
+// Size of the edge queue, has to be a power of two
+#define BUTTON_EVENTS_QUEUE_SIZE 16
+#define BUTTON_EVENTS_MAX_BUTTONS 8
+
+struct ButtonEdge {
+    uint8_t button;
+    uint8_t level; // pin level read in the interrupt
+    uint32_t time; // micros() when the edge was captured
+};
+
+// Button edges are captured in GPIO interrupts into a single-producer / single-consumer ring
+// and debounced on their timestamps when drained from loop(). A level counts once it stayed
+// unchanged for the debounce time, so noise spikes shorter than that never make a press.
+// When the ring overflows the latest edge of each button is still kept, so the final level is not lost.
+class ButtonEvents
+{
+    public:
+        ButtonEvents() {};
+        ButtonEvents(uint32_t debounceTime) : _debounceTime(debounceTime * 1000) {}
+        ~ButtonEvents() {};
+        void ICACHE_RAM_ATTR push(uint8_t button, uint8_t level);
+        // Edges queued or a level still settling, nextPress() has to be called
+        bool pending() { return _head != _tail || _lost != 0 || _settling != 0; }
+        // Drains queued edges, returns true for each debounced press (line held LOW) with the button index and press time
+        bool nextPress(uint8_t &button, uint32_t &time);
+        uint32_t dropped() { return _dropped; }
+    private:
+        ButtonEdge _queue[BUTTON_EVENTS_QUEUE_SIZE];
+        volatile uint8_t _head = 0; // written only by the ISR
+        volatile uint8_t _tail = 0; // written only by loop()
+        volatile uint32_t _dropped = 0;
+        ButtonEdge _latest[BUTTON_EVENTS_MAX_BUTTONS]; // last edge of each button, written only by the ISR
+        volatile uint8_t _lost = 0; // bit per button, its latest edge did not fit into the queue
+
+        uint32_t _debounceTime = 35000; // us, same default as EasyButton
+        uint32_t _lastEdge[BUTTON_EVENTS_MAX_BUTTONS] = {};
+        uint8_t _level[BUTTON_EVENTS_MAX_BUTTONS];
+        uint8_t _settling = 0; // bit per button, level changed less than debounce time ago
+        bool _pressed[BUTTON_EVENTS_MAX_BUTTONS] = {};
+
+        bool settle(uint8_t button);
+        bool replay(const ButtonEdge &edge, uint32_t &time);
+};
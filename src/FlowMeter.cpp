@@ -1,5 +1,8 @@
 #include "FlowMeter.h"
 
+// K-factor used when no calibration curve was set, default value for YF-B5 sensor (f = 6.6 x Q)
+#define FLOWMETER_DEFAULT_FACTOR 6.6
+
 void FlowMeter::begin(uint8_t pin, isrFunctionPointer action) {
     _pin = pin;
 
@@ -22,46 +25,288 @@ void FlowMeter::onFlowChanged(FlowMeter::callback_t callback) {
 	mFlowChangedCallback = callback;
 }
 
+void FlowMeter::onFlowStarted(FlowMeter::callback_t callback) {
+	mFlowStartedCallback = callback;
+}
+
+void FlowMeter::onFlowStopped(FlowMeter::callback_t callback) {
+	mFlowStoppedCallback = callback;
+}
+
+void FlowMeter::setWindow(unsigned long window) {
+    _window = max(window, 100UL);
+}
+
+void FlowMeter::setSmoothing(FlowSmoothing smoothing, uint8_t factor) {
+    _smoothing = smoothing;
+    _smoothingFactor = factor;
+
+    if(_smoothing == FLOW_SMOOTHING_EWMA) {
+        _smoothingFactor = constrain(factor, 1, 100);
+    } else if(_smoothing == FLOW_SMOOTHING_AVERAGE) {
+        _smoothingFactor = constrain(factor, 1, FLOWMETER_AVERAGE_SIZE);
+    }
+
+    resetSmoothing();
+}
+
+void FlowMeter::setTrigger(FlowTrigger trigger, uint8_t threshold) {
+    _trigger = trigger;
+    _triggerThreshold = threshold;
+}
+
+void FlowMeter::resetSmoothing() {
+    _ewmaRate = 0;
+    _averageSum = 0;
+    _averageNext = 0;
+    _averageCount = 0;
+}
+
+// O(1) per window, EWMA in integers or running sum over the ring
+uint32_t FlowMeter::smooth(uint32_t rate) {
+    switch(_smoothing) {
+        case FLOW_SMOOTHING_EWMA:
+            _ewmaRate += (((int32_t)rate << 8) - _ewmaRate) * _smoothingFactor / 100;
+            return _ewmaRate >> 8;
+
+        case FLOW_SMOOTHING_AVERAGE:
+            if(_averageCount == _smoothingFactor) {
+                _averageSum -= _averageRates[_averageNext];
+            } else {
+                _averageCount++;
+            }
+            _averageRates[_averageNext] = rate;
+            _averageSum += rate;
+            _averageNext = (_averageNext + 1) % _smoothingFactor;
+            return _averageSum / _averageCount;
+
+        default:
+            return rate;
+    }
+}
+
+void FlowMeter::setMinPulseInterval(uint32_t microseconds) {
+    _minPulseCycles = microsecondsToClockCycles(microseconds);
+}
+
+void ICACHE_RAM_ATTR FlowMeter::blank(uint32_t milliseconds) {
+    _blankUntilCycles = ESP.getCycleCount() + microsecondsToClockCycles(milliseconds * 1000);
+    _blanking = true;
+}
+
 void ICACHE_RAM_ATTR FlowMeter::counter() {
+  uint32_t now = ESP.getCycleCount();
+
+  // Edges during blanking or too soon after the last accepted pulse are noise
+  if((_blanking && (int32_t)(_blankUntilCycles - now) > 0) || (now - _lastPulseCycles) < _minPulseCycles) {
+    _rejectedPulses++;
+    return;
+  }
+
+  _lastPulseCycles = now;
   _pulseCounter++;
 }
 
+void FlowMeter::clearCalibration() {
+    _calibrationCount = 0;
+}
+
+bool FlowMeter::addCalibrationPoint(float frequency, float factor) {
+    if(frequency < 0 || factor <= 0) {
+        return false;
+    }
+
+    uint32_t fixedFrequency = frequency * 1000;
+    uint32_t fixedFactor = factor * 65536;
+
+    // Keep the table sorted by frequency, same frequency replaces the existing breakpoint
+    uint8_t position = 0;
+    while(position < _calibrationCount && _calibrationFrequency[position] < fixedFrequency) {
+        position++;
+    }
+
+    if(position < _calibrationCount && _calibrationFrequency[position] == fixedFrequency) {
+        _calibrationFactor[position] = fixedFactor;
+        return true;
+    }
+
+    if(_calibrationCount >= FLOWMETER_MAX_CALIBRATION_POINTS) {
+        return false;
+    }
+
+    for(uint8_t i = _calibrationCount; i > position; i--) {
+        _calibrationFrequency[i] = _calibrationFrequency[i - 1];
+        _calibrationFactor[i] = _calibrationFactor[i - 1];
+    }
+
+    _calibrationFrequency[position] = fixedFrequency;
+    _calibrationFactor[position] = fixedFactor;
+    _calibrationCount++;
+
+    return true;
+}
+
+// Linear interpolation between breakpoints, clamped to the first/last one outside of the table
+uint32_t FlowMeter::calibrationFactorFor(uint32_t frequency) {
+    if(_calibrationCount == 0) {
+        return FLOWMETER_DEFAULT_FACTOR * 65536;
+    }
+
+    if(frequency <= _calibrationFrequency[0]) {
+        return _calibrationFactor[0];
+    }
+
+    for(uint8_t i = 1; i < _calibrationCount; i++) {
+        if(frequency < _calibrationFrequency[i]) {
+            int32_t factorDelta = _calibrationFactor[i] - _calibrationFactor[i - 1];
+            uint32_t frequencySpan = _calibrationFrequency[i] - _calibrationFrequency[i - 1];
+
+            return _calibrationFactor[i - 1] + ((int64_t)factorDelta * (frequency - _calibrationFrequency[i - 1])) / (int64_t)frequencySpan;
+        }
+    }
+
+    return _calibrationFactor[_calibrationCount - 1];
+}
+
+void FlowMeter::startCalibration() {
+    _calibrationPulses = 0;
+    _calibrationStart = millis();
+    _calibrationStopped = false;
+    _calibrating = true;
+}
+
+void FlowMeter::stopCalibration() {
+    if(!_calibrating) {
+        return;
+    }
+
+    // Include pulses from the window that was not processed by loop() yet
+    _calibrationPulses += _pulseCounter;
+    _calibrationElapsed = millis() - _calibrationStart;
+    _calibrating = false;
+    _calibrationStopped = true;
+}
+
+bool FlowMeter::finishCalibration(float litres, float &frequency, float &factor) {
+    stopCalibration();
+
+    if(!_calibrationStopped) {
+        return false;
+    }
+
+    _calibrationStopped = false;
+
+    unsigned long pulses = _calibrationPulses;
+    unsigned long elapsed = _calibrationElapsed;
+
+    if(pulses == 0 || elapsed == 0 || litres <= 0) {
+        return false;
+    }
+
+    // f = K x Q, for a run of V litres taking t seconds: f = P / t and Q = 60 x V / t, so K = P / (60 x V)
+    frequency = (pulses * 1000.0) / elapsed;
+    factor = pulses / (60.0 * litres);
+
+    return true;
+}
+
 // Algorithm is based on https://www.instructables.com/id/How-to-Use-Water-Flow-Sensor-Arduino-Tutorial/
 void FlowMeter::loop() {
-  if((millis() - _oldTime) > 1000) // Only process counters once per second
+  // Cycle counter wraps in less than a minute, so blanking has to be ended before the deadline looks like future again
+  if(_blanking && (int32_t)(_blankUntilCycles - ESP.getCycleCount()) <= 0) {
+    _blanking = false;
+  }
+
+  if((millis() - _oldTime) > _window) // Only process counters once per window
   {
-    // Disable the interrupt while calculating flow rate and sending the value to the host
+    // Disable the interrupt while taking over the pulse counter
     detachInterrupt(_pin);
 
-    // Because this loop may not complete in exactly 1 second intervals we calculate
-    // the number of milliseconds that have passed since the last execution and use
-    // that to scale the output. We also apply the calibrationFactor to scale the output
-    // based on the number of pulses per second per units of measure (litres/minute in
-    // this case) coming from the sensor.
-    flowRate = ((1000.0 / (millis() - _oldTime)) * _pulseCounter) / _calibrationFactor;
-
-    // Note the time this processing pass was executed. Note that because we've
-    // disabled interrupts the millis() function won't actually be incrementing right
-    // at this point, but it will still return the value it was set to just before
-    // interrupts went away.
+    // Because this loop may not complete in exactly window long intervals we use
+    // the number of milliseconds that have passed since the last execution.
+    unsigned long elapsed = millis() - _oldTime;
+    uint32_t pulses = _pulseCounter;
+
+    // Reset the pulse counter and enable the interrupt again, the rest works on the copy
+    _pulseCounter = 0;
     _oldTime = millis();
+    attachInterrupt(digitalPinToInterrupt(_pin), _isrCallback, FALLING);
+
+    if(_calibrating) {
+      _calibrationPulses += pulses;
+    }
+
+    float previousFlowRate = flowRate;
+    unsigned int previousFlowMilliLitres = flowMilliLitres;
+
+    // Pulse frequency in mHz selects the K-factor (pulses per second per L/min) from the calibration curve,
+    // everything is in integers so no float division is needed
+    uint32_t frequency = ((uint64_t)pulses * 1000000) / elapsed;
+    uint32_t factor = calibrationFactorFor(frequency);
+
+    // Q [L/min] = f / K, computed in 1/100 L/min
+    uint32_t rate = ((uint64_t)frequency << 16) / ((uint64_t)factor * 10);
+
+    // Flow edges, a gap of one window without pulses is normal for drip flow so stop needs a longer silence
+    bool started = false, stopped = false;
+    if(pulses > 0) {
+        _lastPulseTime = _oldTime;
+        started = !_flowing;
+        _flowing = true;
+    } else if(_flowing && (_oldTime - _lastPulseTime) >= max(_window, (unsigned long)FLOWMETER_STOP_TIMEOUT)) {
+        stopped = true;
+        _flowing = false;
+    }
+
+    if(_flowing) {
+        rate = smooth(rate);
+    } else {
+        resetSmoothing();
+        rate = 0;
+    }
+    flowRate = rate / 100.0;
 
-    // Divide the flow rate in litres/minute by 60 to determine how many litres have
-    // passed through the sensor in this 1 second interval, then multiply by 1000 to
-    // convert to millilitres.
-    flowMilliLitres = (flowRate / 60) * 1000;
+    // Volume of this interval in microlitres is P / (60 x K) litres, carry the remainder
+    // to the next interval so slow drip flow accumulates correctly
+    uint64_t microLitres = ((uint64_t)pulses * 1000000 << 16) / ((uint64_t)factor * 60) + _volumeRemainder;
+    flowMilliLitres = microLitres / 1000;
+    _volumeRemainder = microLitres % 1000;
 
-    // Add the millilitres passed in this second to the cumulative total
+    // Add the millilitres passed in this interval to the cumulative total
     totalMilliLitres += flowMilliLitres;
 
-    if(flowRate > 0 && mFlowChangedCallback) {
-        mFlowChangedCallback(_pin);
+    // Any volume moves the total, even when rate and interval volume repeat under steady flow
+    uint32_t rejected = _rejectedPulses;
+    if(flowRate != previousFlowRate || flowMilliLitres != previousFlowMilliLitres || flowMilliLitres > 0 || rejected != _reportedRejectedPulses) {
+        _reportedRejectedPulses = rejected;
+        _version++;
     }
 
-    // Reset the pulse counter so we can start incrementing again
-    _pulseCounter = 0;
+    if(started && mFlowStartedCallback) {
+        mFlowStartedCallback(_pin);
+    }
 
-    // Enable the interrupt again now that we've finished sending output
-    attachInterrupt(digitalPinToInterrupt(_pin), _isrCallback, FALLING);
+    bool changed = false;
+    switch(_trigger) {
+        case FLOW_TRIGGER_FLOWING:
+            changed = (rate > 0);
+            break;
+        case FLOW_TRIGGER_CHANGE:
+            changed = (rate != _reportedRate) && ((uint64_t)(rate > _reportedRate ? rate - _reportedRate : _reportedRate - rate) * 100 >= (uint64_t)_reportedRate * _triggerThreshold);
+            break;
+        default:
+            break;
+    }
+
+    if(changed) {
+        _reportedRate = rate;
+        if(mFlowChangedCallback) {
+            mFlowChangedCallback(_pin);
+        }
+    }
+
+    if(stopped && mFlowStoppedCallback) {
+        mFlowStoppedCallback(_pin);
+    }
   }
 }
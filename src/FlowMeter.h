@@ -8,6 +8,29 @@
 #include <functional>
 #endif
 
+// Maximum number of breakpoints in the frequency -> K-factor calibration curve
+#define FLOWMETER_MAX_CALIBRATION_POINTS 8
+
+// Maximum number of windows in the moving average
+#define FLOWMETER_AVERAGE_SIZE 8
+
+// Flow is considered stopped after no pulse for this time (ms) or one window, whichever is longer
+#define FLOWMETER_STOP_TIMEOUT 3000
+
+// Smoothing of the reported flow rate
+enum FlowSmoothing {
+    FLOW_SMOOTHING_NONE,
+    FLOW_SMOOTHING_EWMA,    // factor is weight of the new window in %
+    FLOW_SMOOTHING_AVERAGE  // factor is number of windows averaged
+};
+
+// When the flow changed callback is called
+enum FlowTrigger {
+    FLOW_TRIGGER_FLOWING, // after every window with flow
+    FLOW_TRIGGER_CHANGE,  // when the rate moved by more than threshold % from the last reported one
+    FLOW_TRIGGER_EDGES    // never, only flow started / stopped callbacks
+};
+
 class FlowMeter 
 {
     using isrFunctionPointer = void(*)(void);
@@ -24,19 +47,91 @@ class FlowMeter
         volatile uint _pulseCounter;
         FlowMeter() {};
         FlowMeter(uint8_t pin) : _pin(pin) {}
-        FlowMeter(uint8_t pin, float calibrationFactor) : _pin(pin), _calibrationFactor(calibrationFactor) {}
+        FlowMeter(uint8_t pin, float calibrationFactor) : _pin(pin) { addCalibrationPoint(0, calibrationFactor); }
 	    ~FlowMeter() {};
         void begin(uint8_t pin, isrFunctionPointer action);
         void begin(isrFunctionPointer action);
         void loop();
         void ICACHE_RAM_ATTR counter();
         void onFlowChanged(callback_t callback);
+        void onFlowStarted(callback_t callback);
+        void onFlowStopped(callback_t callback);
+
+        // Sampling window (ms), smoothing and callback rule can be changed at runtime
+        void setWindow(unsigned long window);
+        void setSmoothing(FlowSmoothing smoothing, uint8_t factor);
+        void setTrigger(FlowTrigger trigger, uint8_t threshold);
+        bool isFlowing() { return _flowing; }
+
+        // Glitch rejection, pulses closer than the interval to the previous one are dropped
+        void setMinPulseInterval(uint32_t microseconds);
+        // Drops all pulses for the given time, e.g. while a relay coil switches next to the meter wiring
+        void ICACHE_RAM_ATTR blank(uint32_t milliseconds);
+        uint32_t rejectedPulses() { return _rejectedPulses; }
+
+        // Incremented whenever the published readings change, cheap way to detect stale data
+        uint32_t version() { return _version; }
+
+        // Calibration curve, breakpoints are kept sorted by frequency
+        void clearCalibration();
+        bool addCalibrationPoint(float frequency, float factor);
+        uint8_t calibrationPoints() { return _calibrationCount; }
+
+        // Guided calibration: run a known volume through the meter between start and stop, the
+        // measured volume is entered on finish, pulses and time are frozen while it is read out
+        void startCalibration();
+        void stopCalibration();
+        bool isCalibrating() { return _calibrating; }
+        bool isCalibrationStopped() { return _calibrationStopped; }
+        bool finishCalibration(float litres, float &frequency, float &factor);
     private:
         isrFunctionPointer _isrCallback;
         uint8_t _pin;
-        float _calibrationFactor = 6.6; // default value for YF-B5 sensor
         unsigned long _oldTime;
+        unsigned long _window = 1000;
+
+        // Smoothing state, rates in 1/100 L/min
+        FlowSmoothing _smoothing = FLOW_SMOOTHING_NONE;
+        uint8_t _smoothingFactor = 0;
+        int32_t _ewmaRate = 0; // scaled by 256 so small steps do not get lost
+        uint32_t _averageRates[FLOWMETER_AVERAGE_SIZE];
+        uint32_t _averageSum = 0;
+        uint8_t _averageNext = 0;
+        uint8_t _averageCount = 0;
+        uint32_t smooth(uint32_t rate);
+        void resetSmoothing();
+
+        FlowTrigger _trigger = FLOW_TRIGGER_FLOWING;
+        uint8_t _triggerThreshold = 0;
+        uint32_t _reportedRate = 0;
+
+        bool _flowing = false;
+        unsigned long _lastPulseTime;
+
+        // Pulse filter state, all in CPU cycles so the ISR needs no conversions
+        uint32_t _minPulseCycles = 0;
+        volatile uint32_t _lastPulseCycles = 0;
+        volatile uint32_t _blankUntilCycles = 0;
+        volatile bool _blanking = false;
+        volatile uint32_t _rejectedPulses = 0;
+        uint32_t _reportedRejectedPulses = 0;
+        uint32_t _version = 0;
+
+        // Fixed-point calibration table, frequency in mHz and K-factor in Q16.16
+        uint32_t _calibrationFrequency[FLOWMETER_MAX_CALIBRATION_POINTS];
+        uint32_t _calibrationFactor[FLOWMETER_MAX_CALIBRATION_POINTS];
+        uint8_t _calibrationCount = 0;
+        uint32_t _volumeRemainder = 0; // sub-millilitre leftovers, so low flow does not get truncated away
+        uint32_t calibrationFactorFor(uint32_t frequency);
+
+        bool _calibrating = false;
+        bool _calibrationStopped = false;
+        unsigned long _calibrationStart;
+        unsigned long _calibrationElapsed;
+        unsigned long _calibrationPulses;
 
         // CALLBACKS
 	    callback_t mFlowChangedCallback;
+	    callback_t mFlowStartedCallback;
+	    callback_t mFlowStoppedCallback;
 };
@@ -0,0 +1,71 @@
+#include "Interlock.h"
+
+bool Interlock::configure(InterlockMode mode, bool activeLow, uint16_t threshold, uint16_t hysteresis, uint32_t settleTime) {
+    if(mode == _mode && activeLow == _activeLow && threshold == _threshold && hysteresis == _hysteresis && settleTime == _settleTime) {
+        return false;
+    }
+
+    _mode = mode;
+    _activeLow = activeLow;
+    _threshold = threshold;
+    _hysteresis = hysteresis;
+    _settleTime = settleTime;
+
+    _active = false;
+    _sampled = false;
+    _pending = false;
+
+    return true;
+}
+
+const char *Interlock::reason() {
+    if(!_active) {
+        return nullptr;
+    }
+
+    return (_mode == INTERLOCK_SWITCH ? "rain" : "soil");
+}
+
+// Desired inhibit state for the reading, analog sensors have to cross the hysteresis band to release
+bool Interlock::wants(uint16_t value) {
+    switch(_mode) {
+        case INTERLOCK_SWITCH:
+            return (value == 0) == _activeLow;
+        case INTERLOCK_ANALOG:
+            if(_activeLow) {
+                return _active ? value <= (uint32_t)_threshold + _hysteresis : value <= _threshold;
+            }
+            return _active ? value + (uint32_t)_hysteresis >= _threshold : value >= _threshold;
+        default:
+            return false;
+    }
+}
+
+bool Interlock::update(uint16_t value, uint32_t now) {
+    _value = value;
+
+    if(!_sampled) {
+        _sampled = true;
+        _active = wants(value);
+        return _active;
+    }
+
+    if(wants(value) == _active) {
+        _pending = false;
+        return false;
+    }
+
+    if(!_pending) {
+        _pending = true;
+        _pendingSince = now;
+    }
+
+    if(now - _pendingSince < _settleTime) {
+        return false;
+    }
+
+    _active = !_active;
+    _pending = false;
+
+    return true;
+}
@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+// Kind of sensor connected to the interlock input
+enum InterlockMode {
+    INTERLOCK_NONE,
+    INTERLOCK_SWITCH, // rain switch on a digital pin, readings 0 / 1
+    INTERLOCK_ANALOG  // soil moisture (or similar) sensor on the ADC, threshold with hysteresis
+};
+
+// Decides from periodic sensor readings whether irrigation is inhibited. Knows nothing about
+// pins, readings and time are passed in, so it can be driven by a simulated sensor on the host.
+class Interlock
+{
+    public:
+        Interlock() {};
+        ~Interlock() {};
+        // activeLow inhibits on low readings (closed switch to GND, low ADC value), a new state
+        // has to persist for settleTime (ms) before it is taken. Returns false and keeps the
+        // current state when nothing changed, otherwise the next reading is taken as is.
+        bool configure(InterlockMode mode, bool activeLow, uint16_t threshold, uint16_t hysteresis, uint32_t settleTime);
+        // Feeds one reading, returns true when the inhibit state changed
+        bool update(uint16_t value, uint32_t now);
+        bool isActive() { return _active; }
+        InterlockMode mode() { return _mode; }
+        uint16_t value() { return _value; }
+        // Short name of what inhibits irrigation, nullptr when nothing does
+        const char *reason();
+    private:
+        InterlockMode _mode = INTERLOCK_NONE;
+        bool _activeLow = true;
+        uint16_t _threshold = 0;
+        uint16_t _hysteresis = 0;
+        uint32_t _settleTime = 0;
+
+        bool _active = false;
+        bool _sampled = false;   // first reading after configure() is taken without settling
+        bool _pending = false;   // reading disagrees with the current state
+        uint32_t _pendingSince = 0;
+        uint16_t _value = 0;
+
+        bool wants(uint16_t value);
+};
@@ -1,63 +1,130 @@
 #include <FS.h> // FS needs to be the first
 #include <Arduino.h>
+#include "profile.h" // Build profile, enabled features
 #include <WiFiManager.h>
+#if FEATURE_WEB_SERVER
 #include <ESP8266WebServer.h>
+#endif
+#if FEATURE_MQTT
 #include <PubSubClient.h> // MQTT server library
-#include <EasyButton.h>
+#endif
 #include <ArduinoJson.h>
 #include <Ticker.h> // for LED status indications
 #include "settings.h" // Application settings
+#include "pins.h" // HW mapping
 #include "FlowMeter.h" // Flow meter
+#include "ButtonEvents.h" // Interrupt driven buttons
+#include "BufferedPrint.h" // Streaming of API responses
+#include "Interlock.h" // Rain / soil sensor inhibit
 
 // How often send periodic flow meter updates (30 sec.)
 #define FLOW_REPORT_INTERVAL (30 * 1000) 
 
-// if defined /config.json endpoint would be exposed via internal web server for troubleshooting/backup
-#undef DEBUG_CONFIG
-
-// HW mapping
-#define PinMeter1 D5
-#define PinMeter2 D6
-#define PinRelay1 D2
-#define PinRelay2 D3
-#define PinButton1 D7
-#define PinButton2 D4
-#define PinLed1 D0
-#define PinLed2 D1
-#define PinLedStatus D8
-
-// Pin arrays
-const uint8_t BUTTON_PINS[RELAYS_COUNT] = { PinButton1, PinButton2 };
-const uint8_t LED_PINS[RELAYS_COUNT] = { PinLed1, PinLed2 };
-const uint8_t RELAY_PINS[RELAYS_COUNT] = { PinRelay1, PinRelay2 };
-const uint8_t METER_PINS[RELAYS_COUNT] = { PinMeter1, PinMeter2 };
+// How often the health record is published via MQTT
+#define HEALTH_REPORT_INTERVAL (5 * 60 * 1000)
+
+// Flow meter pulses are ignored for this time (ms) after a relay switches, as the coil induces spurious edges (0 disables)
+#define RELAY_SWITCH_BLANKING 5
+
+// Configuration changes are written to flash after this quiet time (ms), so rapid edits result in one write
+#define CONFIG_SAVE_DELAY 2000
+
+// Number of finished irrigation sessions kept in RAM for /api/sessions
+#define SESSIONS_HISTORY 8
+
+// Length of the loop() pause while idle (ms), bounds the reaction time to buttons and network traffic
+#define IDLE_LOOP_DELAY 20
+
+// Interlock sensor is read this often (ms), a changed reading has to hold for the settle time (ms) to count
+#define INTERLOCK_SAMPLE_INTERVAL 500
+#define INTERLOCK_SETTLE_TIME 5000
+
+// Default change of flow rate (%) reported by the flow meters
+#define DEFAULT_FLOW_CHANGE_THRESHOLD 5
+
+// Default minimum interval between flow meter pulses (us), YF-B5 gives ~200 Hz at 30 L/min
+#define DEFAULT_PULSE_FILTER 1000
+
+// if defined (-DDEBUG_CONFIG build flag) /config.json endpoint would be exposed via internal web server for troubleshooting/backup
 
 // schedules LED blinking
 Ticker ticker;
 
 // Management web interface
+#if FEATURE_WEB_SERVER
 ESP8266WebServer server(80);
+#endif
 #define CSS_FILE "/style.css"
 #define JS_FILE "/scripts.js"
 
 // Configuration
 const char *ConfigFileName = "/config.json";
+const char *ConfigTempFileName = "/config.tmp";
+
+// Configuration document structure, room for the copied strings is added when the document is created
+#define CONFIG_JSON_CAPACITY (JSON_OBJECT_SIZE(16) + JSON_ARRAY_SIZE(RELAYS_COUNT) + RELAYS_COUNT * (JSON_OBJECT_SIZE(10) + JSON_ARRAY_SIZE(CALIBRATION_POINTS_COUNT) + CALIBRATION_POINTS_COUNT * JSON_OBJECT_SIZE(2)))
 Configuration Config; 
 
+enum ConfigReadResult {
+  CONFIG_READ_OK,
+  CONFIG_READ_MISSING,
+  CONFIG_READ_INVALID,
+  CONFIG_READ_NO_MEMORY // file may be fine, it just did not fit into memory
+};
+
+// Stored configuration could not be loaded for lack of memory, it must not be overwritten with defaults
+bool configSaveBlocked = false;
+
+// Deferred configuration persistence
+bool configSaveRequested = false;
+unsigned long configSaveRequestedTime;
+
 // MQTT
+#if FEATURE_MQTT
 WiFiClient espClient;
 PubSubClient mqttClient(espClient);
 unsigned long lastMqttConnectionRetryTime;
 unsigned long mqttReconnectDelay = 30000;
 String mqttLwtTopic;
+String mqttHealthTopic;
+String mqttInterlockTopic;
 String mqttTopicRelayStatus[RELAYS_COUNT];
 String mqttTopicRelayCommand[RELAYS_COUNT];
-bool relayState[RELAYS_COUNT];
 
-EasyButton buttons[RELAYS_COUNT] = { 
-  EasyButton(PinButton1), 
-  EasyButton(PinButton2) 
+// Command path counters, for measuring latency and throughput of MQTT control
+struct MqttStats {
+  unsigned long received;
+  unsigned long applied;            // commands which switched a relay
+  unsigned long unchanged;          // commands matching current state (duplicates)
+  unsigned long refused;            // commands for a blocked start or the master zone
+  unsigned long unmatched;          // messages for unknown topics
+  unsigned long handlingTimeTotal;  // us spent handling matched commands, incl. relay switch and state echo
+  unsigned long handlingTimeMax;    // us
+  unsigned long connections;        // successful connections since boot, all but the first are reconnects
 };
+MqttStats mqttStats;
+#endif
+bool relayState[RELAYS_COUNT];
+
+// Incremented on every change of the state served by /api/current (flow meters count their own versions)
+unsigned long stateVersion;
+
+// Random per boot, keeps ETags issued before a restart from matching the restarted counters
+uint32_t bootId;
+
+// Button edges captured by GPIO interrupts, debounced when drained in loop()
+ButtonEvents buttonEvents(35);
+
+// Press to relay switch latency histogram, upper bounds of the buckets in ms (last bucket is everything above)
+const unsigned long BUTTON_LATENCY_BOUNDS[] = { 1, 5, 10, 50, 100, 500 };
+#define BUTTON_LATENCY_BUCKETS (sizeof(BUTTON_LATENCY_BOUNDS) / sizeof(BUTTON_LATENCY_BOUNDS[0]) + 1)
+unsigned long buttonLatencyHistogram[BUTTON_LATENCY_BUCKETS];
+unsigned long buttonLatencyMax; // us
+
+// Rain / soil sensor blocking zone starts
+Interlock interlock;
+unsigned long lastInterlockSample;
+unsigned long interlockBlocked; // starts refused since boot
 
 // https://github.com/sekdiy/FlowMeter/wiki/Properties
 // For YF-B5 sensor (f = 6.6 x Q)
@@ -71,9 +138,87 @@ FlowMeter meters[RELAYS_COUNT] = {
 // millis when relays should be turned off
 unsigned long relayTimeoutWhen[RELAYS_COUNT];
 
+// meter total (ml) when relays should be turned off, 0 = no volume limit
+unsigned long relayVolumeLimit[RELAYS_COUNT];
+
+// Calibration run requested, it starts counting once the zone valve actually opens
+bool calibrationPending[RELAYS_COUNT];
+
+// Master valve sequencing, zones waiting for the master to pressurise the line and its delayed closing
+bool relayStartPending[RELAYS_COUNT];
+unsigned long relayStartWhen[RELAYS_COUNT];
+unsigned long masterOpenedWhen;
+bool masterClosePending = false;
+unsigned long masterCloseWhen;
+
 // flow meter updates
 unsigned long lastFlowMeterUpdate[RELAYS_COUNT];
 
+// Power states, device is idle when no zone runs and nothing is scheduled
+enum PowerState {
+  POWER_ACTIVE,
+  POWER_IDLE
+};
+PowerState powerState = POWER_ACTIVE;
+unsigned long powerStateSince;
+unsigned long powerStateTime[2]; // ms spent in each state, excluding the current period
+
+// Longest loop() pass (us) without the idle pause, shows how far behind the command processing can fall
+unsigned long loopLagMax;
+
+// Parts of loop(), the longest single one since boot is reported as the stall in the health record
+enum LoopStage {
+  STAGE_HTTP,
+  STAGE_MQTT,
+  STAGE_CONFIG,
+  STAGE_BUTTONS,
+  STAGE_MASTER,
+  STAGE_INTERLOCK,
+  STAGE_METERS
+};
+const char *LOOP_STAGE_NAMES[] = { "http", "mqtt", "config", "buttons", "master", "interlock", "meters" };
+LoopStage loopStallStage;
+unsigned long loopStallMax; // us
+
+unsigned long lastHealthReport;
+
+// What switched the relay, recorded in the irrigation sessions
+enum RelaySource {
+  SOURCE_WEB,
+  SOURCE_BUTTON,
+  SOURCE_MQTT,
+  SOURCE_API,
+  SOURCE_TIMEOUT,
+  SOURCE_VOLUME,
+  SOURCE_CALIBRATION,
+  SOURCE_INTERLOCK
+};
+
+// One irrigation run of a zone, from relay on to relay off
+struct IrrigationSession {
+  uint8_t zone;
+  RelaySource startedBy;
+  RelaySource endedBy;
+  unsigned long start;        // millis when the relay was turned on
+  unsigned long duration;     // ms
+  unsigned long volume;       // ml
+  unsigned long startVolume;  // meter total (ml) when the relay was turned on
+  float peakFlow;             // L/min
+};
+
+// sessions in progress, indexed by zone
+IrrigationSession activeSessions[RELAYS_COUNT];
+
+// source and limits of the zone start delayed by the master valve
+RelaySource relayStartSource[RELAYS_COUNT];
+unsigned long relayStartDuration[RELAYS_COUNT]; // s
+unsigned long relayStartVolume[RELAYS_COUNT];   // ml
+
+// ring of finished sessions
+IrrigationSession sessionsHistory[SESSIONS_HISTORY];
+uint8_t sessionsHistoryNext = 0;
+uint8_t sessionsHistoryCount = 0;
+
 File getFile(String fileName) {
   File file;
   if (SPIFFS.exists(fileName)) {
@@ -83,62 +228,166 @@ File getFile(String fileName) {
 }
 
 // Configuration handling
-void readConfigurationFile() {
-  Serial.println("[CONFIG] Reading configuration.");
+void setDefaultConfiguration() {
+  Config.power_save = POWER_SAVE_MODEM;
+  Config.master_relay = 0;
+  Config.master_lead = 0;
+  Config.master_lag = 0;
+  Config.interlock_mode = INTERLOCK_NONE;
+  Config.interlock_active_low = true;
+  Config.interlock_threshold = 512;
+  Config.interlock_hysteresis = 50;
+  Config.interlock_stop = false;
 
-  // set defaults
   for(int i = 0; i < RELAYS_COUNT; i++) {
     Config.relays[i].name = String("Relay " + String(i + 1));
     Config.relays[i].timeout = 0;
+    Config.relays[i].pulseFilter = DEFAULT_PULSE_FILTER;
+    Config.relays[i].meterWindow = 1000;
+    Config.relays[i].meterSmoothing = FLOW_SMOOTHING_NONE;
+    Config.relays[i].meterSmoothingFactor = 0;
+    Config.relays[i].meterTrigger = FLOW_TRIGGER_CHANGE;
+    Config.relays[i].meterThreshold = DEFAULT_FLOW_CHANGE_THRESHOLD;
+    Config.relays[i].calibrationPoints = 1;
+    Config.relays[i].calibration[0].frequency = 0;
+    Config.relays[i].calibration[0].factor = flowMeterCalibrationFactor;
+
+    Log.println(Config.relays[i].name);
+  }
+}
 
-    Serial.println(Config.relays[i].name);
+// Loads configuration from the file, Config is touched only when the whole file parses
+ConfigReadResult readConfigurationFrom(const char *fileName) {
+  if(!SPIFFS.exists(fileName)) {
+    return CONFIG_READ_MISSING;
   }
 
-  // read config file
-  if(SPIFFS.exists(ConfigFileName))
-  {
-    Serial.println("Reading existing configuration.");
+  Log.printf("[CONFIG] Reading configuration from %s.", fileName);
+  Log.println();
 
-    File configFile = SPIFFS.open(ConfigFileName, "r");
+  File configFile = SPIFFS.open(fileName, "r");
 
-    StaticJsonDocument<512> json;
-    DeserializationError error = deserializeJson(json, configFile);
-    if (error) {
-      Serial.println(F("Failed to read file, using default configuration"));
-      return;
-    }
+  // Keys and values are copied from the stream, none of them is longer than the file itself
+  size_t fileSize = configFile.size();
+  DynamicJsonDocument json(CONFIG_JSON_CAPACITY + fileSize);
+  DeserializationError error = deserializeJson(json, configFile);
+  configFile.close();
 
-    // Copy values from the JsonDocument to the Config
-    // https://arduinojson.org/v6/example/config/
-    Config.mqtt_port = json["mqtt_port"] | 1883;
-    Config.mqtt_server = json["mqtt_server"].as<String>();
-    Config.mqtt_user = json["mqtt_user"].as<String>();
-    Config.mqtt_password = json["mqtt_password"].as<String>();
-    Config.mqtt_channel_prefix = json["mqtt_channel_prefix"].as<String>();
-    
-    if(json.containsKey("relays")) {
-      JsonArray relays = json["relays"].as<JsonArray>();
-      if(!relays.isNull()) {
-        int i = 0;
-        for(JsonObject relay : relays) {
-          Config.relays[i].name = relay["name"].as<String>();
-          Config.relays[i].timeout = relay["timeout"] | 0;
-          i++;
+  if(error == DeserializationError::NoMemory || json.capacity() == 0) {
+    Log.printf("[CONFIG] Not enough memory to read %s (%u bytes).", fileName, fileSize);
+    Log.println();
+    return CONFIG_READ_NO_MEMORY;
+  }
+
+  // Truncated file (e.g. power loss while writing) does not parse
+  if (error || !json.containsKey("relays")) {
+    Log.printf("[CONFIG] File %s is not valid (%s).", fileName, error.c_str());
+    Log.println();
+    return CONFIG_READ_INVALID;
+  }
+
+  // Copy values from the JsonDocument to the Config
+  // https://arduinojson.org/v6/example/config/
+  Config.mqtt_port = json["mqtt_port"] | 1883;
+  Config.mqtt_server = json["mqtt_server"].as<String>();
+  Config.mqtt_user = json["mqtt_user"].as<String>();
+  Config.mqtt_password = json["mqtt_password"].as<String>();
+  Config.mqtt_channel_prefix = json["mqtt_channel_prefix"].as<String>();
+  Config.power_save = json["power_save"] | POWER_SAVE_MODEM;
+  Config.master_relay = json["master_relay"] | 0;
+  Config.master_lead = json["master_lead"] | 0;
+  Config.master_lag = json["master_lag"] | 0;
+  Config.interlock_mode = json["interlock_mode"] | (int)INTERLOCK_NONE;
+  Config.interlock_active_low = json["interlock_active_low"] | true;
+  Config.interlock_threshold = json["interlock_threshold"] | 512;
+  Config.interlock_hysteresis = json["interlock_hysteresis"] | 50;
+  Config.interlock_stop = json["interlock_stop"] | false;
+  
+  JsonArray relays = json["relays"].as<JsonArray>();
+  if(!relays.isNull()) {
+    int i = 0;
+    for(JsonObject relay : relays) {
+      if(i >= RELAYS_COUNT) {
+        break;
+      }
+
+      Config.relays[i].name = relay["name"].as<String>();
+      Config.relays[i].timeout = relay["timeout"] | 0;
+      Config.relays[i].pulseFilter = relay["pulse_filter"] | DEFAULT_PULSE_FILTER;
+      Config.relays[i].meterWindow = relay["meter_window"] | 1000;
+      Config.relays[i].meterSmoothing = relay["meter_smoothing"] | (int)FLOW_SMOOTHING_NONE;
+      Config.relays[i].meterSmoothingFactor = relay["meter_smoothing_factor"] | 0;
+      Config.relays[i].meterTrigger = relay["meter_trigger"] | (int)FLOW_TRIGGER_CHANGE;
+      Config.relays[i].meterThreshold = relay["meter_threshold"] | DEFAULT_FLOW_CHANGE_THRESHOLD;
+
+      JsonArray calibration = relay["calibration"].as<JsonArray>();
+      if(!calibration.isNull()) {
+        uint8_t points = 0;
+        for(JsonObject point : calibration) {
+          if(points >= CALIBRATION_POINTS_COUNT) {
+            break;
+          }
+          Config.relays[i].calibration[points].frequency = point["frequency"] | 0.0;
+          Config.relays[i].calibration[points].factor = point["factor"] | flowMeterCalibrationFactor;
+          points++;
         }
+        Config.relays[i].calibrationPoints = points;
       }
+      i++;
     }
+  }
+
+  return CONFIG_READ_OK;
+}
+
+void readConfigurationFile() {
+  Log.println("[CONFIG] Reading configuration.");
+
+  setDefaultConfiguration();
+
+  ConfigReadResult result = readConfigurationFrom(ConfigFileName);
+  if(result == CONFIG_READ_OK) {
+    return;
+  }
 
-    configFile.close();
+  // Not a corrupt file, keep it for the next boot instead of replacing it by the temporary file or defaults
+  if(result == CONFIG_READ_NO_MEMORY) {
+    Log.println("[CONFIG] Using default configuration, saving is disabled until restart.");
+    configSaveBlocked = true;
+    return;
   }
+
+  // Power loss between removing the old file and renaming the new one leaves only the temporary file
+  if(readConfigurationFrom(ConfigTempFileName) == CONFIG_READ_OK) {
+    Log.println("[CONFIG] Recovered configuration from temporary file.");
+
+    SPIFFS.remove(ConfigFileName);
+    SPIFFS.rename(ConfigTempFileName, ConfigFileName);
+    return;
+  }
+
+  Log.println(F("Failed to read file, using default configuration"));
+  setDefaultConfiguration();
 }
 
+// Writes configuration to a temporary file first and replaces the real one only when it was fully written,
+// so power loss in the middle never leaves a truncated /config.json behind.
 void saveConfigurationFile() {
-  Serial.println("Saving configuration file.");
+  Log.println("Saving configuration file.");
 
-  File configFile = SPIFFS.open(ConfigFileName, "w");
+  configSaveRequested = false;
 
-  // Use arduinojson.org/assistant to compute the capacity.
-  StaticJsonDocument<640> jsonDocument;
+  if(configSaveBlocked) {
+    Log.println("[CONFIG] Stored configuration was not loaded, not overwriting it.");
+    return;
+  }
+
+  // Strings are copied into the document, keys are literals and are not
+  size_t stringsSize = Config.mqtt_server.length() + Config.mqtt_user.length() + Config.mqtt_password.length() + Config.mqtt_channel_prefix.length() + 4;
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    stringsSize += Config.relays[i].name.length() + 1;
+  }
+  DynamicJsonDocument jsonDocument(CONFIG_JSON_CAPACITY + stringsSize);
 
   // Set global values 
   jsonDocument["mqtt_server"] = Config.mqtt_server;
@@ -146,6 +395,15 @@ void saveConfigurationFile() {
   jsonDocument["mqtt_user"] = Config.mqtt_user;
   jsonDocument["mqtt_password"] = Config.mqtt_password;
   jsonDocument["mqtt_channel_prefix"] = Config.mqtt_channel_prefix;
+  jsonDocument["power_save"] = Config.power_save;
+  jsonDocument["master_relay"] = Config.master_relay;
+  jsonDocument["master_lead"] = Config.master_lead;
+  jsonDocument["master_lag"] = Config.master_lag;
+  jsonDocument["interlock_mode"] = Config.interlock_mode;
+  jsonDocument["interlock_active_low"] = Config.interlock_active_low;
+  jsonDocument["interlock_threshold"] = Config.interlock_threshold;
+  jsonDocument["interlock_hysteresis"] = Config.interlock_hysteresis;
+  jsonDocument["interlock_stop"] = Config.interlock_stop;
 
   // and per relay
   JsonArray relays = jsonDocument.createNestedArray("relays");
@@ -153,15 +411,226 @@ void saveConfigurationFile() {
     JsonObject relay = relays.createNestedObject();
     relay["name"] = Config.relays[i].name;
     relay["timeout"] = Config.relays[i].timeout;
+    relay["pulse_filter"] = Config.relays[i].pulseFilter;
+    relay["meter_window"] = Config.relays[i].meterWindow;
+    relay["meter_smoothing"] = Config.relays[i].meterSmoothing;
+    relay["meter_smoothing_factor"] = Config.relays[i].meterSmoothingFactor;
+    relay["meter_trigger"] = Config.relays[i].meterTrigger;
+    relay["meter_threshold"] = Config.relays[i].meterThreshold;
+
+    JsonArray calibration = relay.createNestedArray("calibration");
+    for(int p = 0; p < Config.relays[i].calibrationPoints; p++) {
+      JsonObject point = calibration.createNestedObject();
+      point["frequency"] = Config.relays[i].calibration[p].frequency;
+      point["factor"] = Config.relays[i].calibration[p].factor;
+    }
   }
 
-  // Serialize JSON to file
-  if (serializeJson(jsonDocument, configFile) == 0) {
-    Serial.println(F("Failed to write settings file."));
+  // Values left out for lack of room would be lost silently
+  if(jsonDocument.overflowed()) {
+    Log.println(F("Settings do not fit into memory, not saving."));
+    return;
+  }
+
+  File configFile = SPIFFS.open(ConfigTempFileName, "w");
+  if(!configFile) {
+    Log.println(F("Failed to create settings file."));
+    return;
   }
 
+  // Serialize JSON to file
+  size_t expected = measureJson(jsonDocument);
+  size_t written = serializeJson(jsonDocument, configFile);
+
   // Close the file
   configFile.close();
+
+  if (written == 0 || written != expected) {
+    Log.println(F("Failed to write settings file."));
+    SPIFFS.remove(ConfigTempFileName);
+    return;
+  }
+
+  // SPIFFS cannot rename over an existing file
+  SPIFFS.remove(ConfigFileName);
+  if(!SPIFFS.rename(ConfigTempFileName, ConfigFileName)) {
+    Log.println(F("Failed to replace settings file."));
+  }
+}
+
+// Schedules configuration write, rapid changes are coalesced into a single flash write done from loop()
+void requestConfigurationSave() {
+  configSaveRequested = true;
+  configSaveRequestedTime = millis();
+}
+
+// Pushes calibration curves, pulse filters and sampling from configuration into the flow meters
+void applyMeterSettings() {
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    meters[i].setMinPulseInterval(Config.relays[i].pulseFilter);
+    meters[i].setWindow(Config.relays[i].meterWindow);
+    meters[i].setSmoothing((FlowSmoothing)Config.relays[i].meterSmoothing, Config.relays[i].meterSmoothingFactor);
+    meters[i].setTrigger((FlowTrigger)Config.relays[i].meterTrigger, Config.relays[i].meterThreshold);
+    meters[i].clearCalibration();
+    for(int p = 0; p < Config.relays[i].calibrationPoints; p++) {
+      meters[i].addCalibrationPoint(Config.relays[i].calibration[p].frequency, Config.relays[i].calibration[p].factor);
+    }
+  }
+}
+
+#if FEATURE_WEB_UI
+// Serializes calibration curve as "frequency:factor;frequency:factor" for the settings form
+String calibrationToString(RelayConfiguration &relay) {
+  String value;
+  for(int p = 0; p < relay.calibrationPoints; p++) {
+    if(p > 0) {
+      value += ";";
+    }
+    value += String(relay.calibration[p].frequency, 2) + ":" + String(relay.calibration[p].factor, 3);
+  }
+  return value;
+}
+
+// Parses calibration curve from the settings form, invalid pairs are skipped
+void calibrationFromString(RelayConfiguration &relay, String value) {
+  uint8_t points = 0;
+  while(value.length() > 0 && points < CALIBRATION_POINTS_COUNT) {
+    int separator = value.indexOf(';');
+    String pair = (separator < 0 ? value : value.substring(0, separator));
+    value = (separator < 0 ? String() : value.substring(separator + 1));
+
+    int colon = pair.indexOf(':');
+    if(colon < 0) {
+      continue;
+    }
+
+    float frequency = pair.substring(0, colon).toFloat();
+    float factor = pair.substring(colon + 1).toFloat();
+    if(frequency < 0 || factor <= 0) {
+      continue;
+    }
+
+    relay.calibration[points].frequency = frequency;
+    relay.calibration[points].factor = factor;
+    points++;
+  }
+
+  // Never leave the meter without a curve
+  if(points == 0) {
+    relay.calibration[0].frequency = 0;
+    relay.calibration[0].factor = flowMeterCalibrationFactor;
+    points = 1;
+  }
+
+  relay.calibrationPoints = points;
+}
+
+// Fits a point measured by the guided calibration into the curve. A point close to an existing
+// breakpoint (within 15 % of its frequency) replaces it, otherwise it is added, or when the table
+// is full the nearest breakpoint is replaced.
+void fitCalibrationPoint(RelayConfiguration &relay, float frequency, float factor) {
+  // Uncalibrated default (single 0 Hz point) would keep pulling low flow readings towards it
+  if(relay.calibrationPoints == 1 && relay.calibration[0].frequency == 0) {
+    relay.calibrationPoints = 0;
+  }
+
+  int nearest = -1;
+  float nearestDistance = 0;
+  for(int p = 0; p < relay.calibrationPoints; p++) {
+    float distance = fabs(relay.calibration[p].frequency - frequency);
+    if(nearest < 0 || distance < nearestDistance) {
+      nearest = p;
+      nearestDistance = distance;
+    }
+  }
+
+  int target = nearest;
+  if(nearest < 0 || (nearestDistance > frequency * 0.15 && relay.calibrationPoints < CALIBRATION_POINTS_COUNT)) {
+    target = relay.calibrationPoints++;
+  }
+
+  relay.calibration[target].frequency = frequency;
+  relay.calibration[target].factor = factor;
+
+  // keep sorted by frequency
+  for(int p = target; p > 0 && relay.calibration[p - 1].frequency > relay.calibration[p].frequency; p--) {
+    CalibrationPoint point = relay.calibration[p];
+    relay.calibration[p] = relay.calibration[p - 1];
+    relay.calibration[p - 1] = point;
+  }
+  for(int p = target; p < relay.calibrationPoints - 1 && relay.calibration[p + 1].frequency < relay.calibration[p].frequency; p++) {
+    CalibrationPoint point = relay.calibration[p];
+    relay.calibration[p] = relay.calibration[p + 1];
+    relay.calibration[p + 1] = point;
+  }
+}
+#endif
+
+// Index of the relay acting as master valve / pump, -1 if there is none
+int masterRelay() {
+  if(Config.master_relay < 1 || Config.master_relay > RELAYS_COUNT) {
+    return -1;
+  }
+  return Config.master_relay - 1;
+}
+
+// Relay is on or waits for the master valve to pressurise the line
+bool relayRequested(int id) {
+  return relayState[id] || relayStartPending[id];
+}
+
+// Nothing runs and nothing is scheduled, so loop() does not need to spin
+bool canIdle() {
+  if(Config.power_save == POWER_SAVE_NONE || configSaveRequested || buttonEvents.pending() || masterClosePending) {
+    return false;
+  }
+
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    if(relayRequested(i) || relayTimeoutWhen[i] > 0 || relayVolumeLimit[i] > 0 || meters[i].isFlowing() || meters[i].isCalibrating()) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void setPowerState(PowerState state) {
+  if(state == powerState) {
+    return;
+  }
+
+  unsigned long now = millis();
+  powerStateTime[powerState] += now - powerStateSince;
+  powerStateSince = now;
+  powerState = state;
+  stateVersion++;
+
+  if(state == POWER_IDLE) {
+    Log.println("[POWER] Entering idle mode.");
+
+    // Light sleep suspends the CPU inside delay(), it is woken by the timer, GPIO and DTIM beacons
+    WiFi.setSleepMode(Config.power_save == POWER_SAVE_LIGHT ? WIFI_LIGHT_SLEEP : WIFI_MODEM_SLEEP);
+  } else {
+    Log.println("[POWER] Leaving idle mode.");
+
+    // Keep the radio awake while watering for the lowest command latency
+    WiFi.setSleepMode(WIFI_NONE_SLEEP);
+  }
+}
+
+unsigned long powerStateSeconds(PowerState state) {
+  unsigned long time = powerStateTime[state];
+  if(state == powerState) {
+    time += millis() - powerStateSince;
+  }
+  return time / 1000;
+}
+
+const char *powerStateName() {
+  if(powerState == POWER_ACTIVE) {
+    return "active";
+  }
+  return (Config.power_save == POWER_SAVE_LIGHT ? "light-sleep" : "modem-sleep");
 }
 
 void tickStatusLed() {
@@ -169,85 +638,491 @@ void tickStatusLed() {
   int state = digitalRead(PinLedStatus);  // get the current state of GPIO1 pin
   digitalWrite(PinLedStatus, !state);     // set pin to the opposite state
 
-  Serial.println("Status LED tick.");
+  Log.println("Status LED tick.");
 }
 
-void toggleRelay(int id) {
-  if(id >= RELAYS_COUNT) {
-    Serial.printf("[RELAY] Wrong relay ID (%i) passed, ignoring.", id);
-    Serial.println();
-    return;
+const char *relaySourceName(RelaySource source) {
+  switch(source) {
+    case SOURCE_WEB: return "web";
+    case SOURCE_BUTTON: return "button";
+    case SOURCE_MQTT: return "mqtt";
+    case SOURCE_API: return "api";
+    case SOURCE_TIMEOUT: return "timeout";
+    case SOURCE_VOLUME: return "volume";
+    case SOURCE_CALIBRATION: return "calibration";
+    case SOURCE_INTERLOCK: return "interlock";
   }
-  
-  uint8_t relayPin = RELAY_PINS[id];
-  uint8_t ledPin = LED_PINS[id];
-  String channel = mqttTopicRelayStatus[id];
+  return "unknown";
+}
+
+void serializeSession(IrrigationSession &session, JsonObject json) {
+  json["zone"] = session.zone + 1;
+  json["start"] = session.start / 1000;
+  json["duration"] = session.duration / 1000;
+  json["volume"] = session.volume / 1000.0;
+  json["averageFlow"] = (session.duration > 0 ? (session.volume * 60.0) / session.duration : 0); // ml/ms -> L/min
+  json["peakFlow"] = session.peakFlow;
+  json["startedBy"] = relaySourceName(session.startedBy);
+  json["endedBy"] = relaySourceName(session.endedBy);
+}
+
+void openSession(int id, RelaySource source) {
+  IrrigationSession &session = activeSessions[id];
+  session.zone = id;
+  session.startedBy = source;
+  session.start = millis();
+  session.startVolume = meters[id].totalMilliLitres;
+  session.peakFlow = 0;
+}
+
+// Finalizes the session, keeps it in the history ring and publishes it to retained MQTT topic
+void closeSession(int id, RelaySource source) {
+  IrrigationSession &session = activeSessions[id];
+  session.endedBy = source;
+  session.duration = millis() - session.start;
+  session.volume = meters[id].totalMilliLitres - session.startVolume;
+
+  sessionsHistory[sessionsHistoryNext] = session;
+  sessionsHistoryNext = (sessionsHistoryNext + 1) % SESSIONS_HISTORY;
+  if(sessionsHistoryCount < SESSIONS_HISTORY) {
+    sessionsHistoryCount++;
+  }
+
+  Log.printf("[SESSION] Zone %i ran %lu s, %lu ml, ended by %s.", id, session.duration / 1000, session.volume, relaySourceName(source));
+  Log.println();
+
+#if FEATURE_MQTT
+  if(mqttClient.connected()) {
+    StaticJsonDocument<JSON_OBJECT_SIZE(8)> jsonDocument;
+    serializeSession(session, jsonDocument.to<JsonObject>());
+
+    String value;
+    serializeJson(jsonDocument, value);
+
+    String channel = String(Config.mqtt_channel_prefix + (id + 1) + "/session");
+    mqttClient.publish(channel.c_str(), value.c_str(), true);
+  }
+#endif
+}
 
-  int currentValue = digitalRead(relayPin);
-  int newValue = !currentValue;
+// Physically switches the relay and its LED and publishes the new state
+void writeRelay(int id, bool state) {
+  Log.printf("Switching relay #%i from %i to %i.", id, relayState[id], state);
+  Log.println();
 
-  Serial.printf("Toggling relay #%i from %i to %i.", id, currentValue, newValue);
-  Serial.println();
+  // Relay coils are close to the meter wiring, ignore pulses while switching
+  if(RELAY_SWITCH_BLANKING > 0) {
+    for(int i = 0; i < RELAYS_COUNT; i++) {
+      meters[i].blank(RELAY_SWITCH_BLANKING);
+    }
+  }
 
-  // Do the toggle
   // HIGH (0x1) = OFF, LOW (0x0) = ON
-  digitalWrite(relayPin, newValue); // relay
-  digitalWrite(ledPin, !newValue); // led
+  digitalWrite(RELAY_PINS[id], !state); // relay
+  digitalWrite(LED_PINS[id], state); // led
   
-  relayState[id] = !newValue;
+  relayState[id] = state;
+  stateVersion++;
+
+  // And publish state update via MQTT
+#if FEATURE_MQTT
+  if(mqttClient.connected()) {
+    Log.println("[MQTT] Publishing updated state after toggle.");
 
-  if(relayState[id] && Config.relays[id].timeout > 0) { // if enabling and is timeout set, activate
+    String value = String(relayState[id]);
+    mqttClient.publish(mqttTopicRelayStatus[id].c_str(), value.c_str());
+  }
+#endif
+}
+
+// Toggles the zone valve right away, with its timers and session. Duration (s) replaces
+// the configured timeout and volume (ml) limits the run, 0 for either means not requested
+void switchRelay(int id, RelaySource source, unsigned long duration = 0, unsigned long volume = 0) {
+  writeRelay(id, !relayState[id]);
+
+  // Calibration measures only the time the valve is open, whatever closes it ends the run
+  if(relayState[id] && calibrationPending[id]) {
+    calibrationPending[id] = false;
+    meters[id].startCalibration();
+  } else if(!relayState[id]) {
+    meters[id].stopCalibration();
+  }
+
+  if(relayState[id] && duration > 0) {
+    relayTimeoutWhen[id] = millis() + duration * 1000;
+  } else if(relayState[id] && Config.relays[id].timeout > 0) { // if enabling and is timeout set, activate
     relayTimeoutWhen[id] = millis() + (Config.relays[id].timeout * 60 * 1000);
   } else {
     relayTimeoutWhen[id] = 0;
   }
+  relayVolumeLimit[id] = (relayState[id] && volume > 0 ? meters[id].totalMilliLitres + volume : 0);
 
-  // And publish state update via MQTT
-  if(mqttClient.connected()) {
-    Serial.println("[MQTT] Publishing updated state after toggle.");
+  if(relayState[id]) {
+    openSession(id, source);
+  } else {
+    closeSession(id, source);
+  }
+}
 
-    String value = String(relayState[id]);
-    mqttClient.publish(channel.c_str(), value.c_str());
+// Closes the master after the lag time once the last zone is off, a zone started
+// in the meantime keeps it open so back to back zones do not cycle it
+void scheduleMasterClose() {
+  int master = masterRelay();
+  if(master < 0 || !relayState[master]) {
+    return;
+  }
+
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    if(i != master && relayRequested(i)) {
+      return;
+    }
+  }
+
+  masterCloseWhen = millis() + Config.master_lag * 1000;
+  masterClosePending = true;
+}
+
+void toggleRelay(int id, RelaySource source, unsigned long duration = 0, unsigned long volume = 0) {
+  if(id < 0 || id >= RELAYS_COUNT) {
+    Log.printf("[RELAY] Wrong relay ID (%i) passed, ignoring.", id);
+    Log.println();
+    return;
+  }
+
+  int master = masterRelay();
+  if(id == master) {
+    Log.printf("[MASTER] Relay %i is the master valve, it is switched automatically.", id);
+    Log.println();
+    return;
+  }
+
+  // Zone still waiting for the master valve, just cancel the start
+  if(relayStartPending[id]) {
+    relayStartPending[id] = false;
+    calibrationPending[id] = false;
+    scheduleMasterClose();
+    return;
+  }
+
+  // Rain / soil sensor blocks starts from every source, stopping is always possible
+  if(!relayState[id] && interlock.isActive()) {
+    Log.printf("[INTERLOCK] Start of relay %i blocked by %s sensor.", id, interlock.reason());
+    Log.println();
+
+    interlockBlocked++;
+    stateVersion++;
+
+#if FEATURE_MQTT
+    // Echo the unchanged state so optimistic clients roll back
+    if(mqttClient.connected()) {
+      mqttClient.publish(mqttTopicRelayStatus[id].c_str(), "0");
+    }
+#endif
+    return;
+  }
+
+  if(!relayState[id] && master >= 0) {
+    masterClosePending = false;
+
+    if(!relayState[master]) {
+      Log.println("[MASTER] Opening master valve.");
+      writeRelay(master, true);
+      masterOpenedWhen = millis();
+    }
+
+    // Open the zone once the master pressurised the line
+    unsigned long pressurisedWhen = masterOpenedWhen + Config.master_lead;
+    if((long)(pressurisedWhen - millis()) > 0) {
+      relayStartWhen[id] = pressurisedWhen;
+      relayStartSource[id] = source;
+      relayStartDuration[id] = duration;
+      relayStartVolume[id] = volume;
+      relayStartPending[id] = true;
+      return;
+    }
+  }
+
+  switchRelay(id, source, duration, volume);
+
+  if(!relayState[id]) {
+    scheduleMasterClose();
+  }
+}
+
+// Delayed zone starts and master valve closing
+void processMasterSequence() {
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    if(relayStartPending[i] && (long)(millis() - relayStartWhen[i]) >= 0) {
+      relayStartPending[i] = false;
+
+      // Interlock went active while the master was pressurising the line
+      if(interlock.isActive()) {
+        Log.printf("[INTERLOCK] Pending start of relay %i cancelled.", i);
+        Log.println();
+        interlockBlocked++;
+        stateVersion++;
+        calibrationPending[i] = false;
+        scheduleMasterClose();
+        continue;
+      }
+
+      switchRelay(i, relayStartSource[i], relayStartDuration[i], relayStartVolume[i]);
+    }
+  }
+
+  int master = masterRelay();
+  if(masterClosePending && (long)(millis() - masterCloseWhen) >= 0) {
+    masterClosePending = false;
+
+    if(master >= 0 && relayState[master]) {
+      Log.println("[MASTER] Closing master valve.");
+      writeRelay(master, false);
+    }
+  }
+}
+
+// Switches relay to the requested state, a zone already on just gets the new duration (s) / volume (ml) limits
+void setRelay(int id, bool state, RelaySource source, unsigned long duration = 0, unsigned long volume = 0) {
+  if(id < 0 || id >= RELAYS_COUNT) {
+    return;
+  }
+
+  if(relayRequested(id) != state) {
+    toggleRelay(id, source, duration, volume);
+    return;
+  }
+
+  if(!state) {
+    return;
+  }
+
+  if(relayStartPending[id]) {
+    if(duration > 0) {
+      relayStartDuration[id] = duration;
+    }
+    if(volume > 0) {
+      relayStartVolume[id] = volume;
+    }
+    return;
+  }
+
+  if(duration > 0) {
+    relayTimeoutWhen[id] = millis() + duration * 1000;
+    stateVersion++;
+  }
+  if(volume > 0) {
+    relayVolumeLimit[id] = meters[id].totalMilliLitres + volume;
+  }
+}
+
+#if FEATURE_MQTT
+// Publishes retained interlock state next to the LWT topic
+void publishInterlock() {
+  if(!mqttClient.connected()) {
+    return;
+  }
+
+  StaticJsonDocument<JSON_OBJECT_SIZE(3)> jsonDocument;
+  jsonDocument["active"] = interlock.isActive();
+  jsonDocument["reason"] = interlock.reason();
+  jsonDocument["value"] = interlock.value();
+
+  String value;
+  serializeJson(jsonDocument, value);
+
+  mqttClient.publish(mqttInterlockTopic.c_str(), value.c_str(), true);
+}
+#endif
+
+void interlockChanged() {
+  stateVersion++;
+
+  if(interlock.isActive()) {
+    Log.printf("[INTERLOCK] Irrigation inhibited by %s sensor, reading %u.", interlock.reason(), interlock.value());
+  } else {
+    Log.printf("[INTERLOCK] Irrigation allowed again, reading %u.", interlock.value());
+  }
+  Log.println();
+
+  if(interlock.isActive() && Config.interlock_stop) {
+    int master = masterRelay();
+    for(int i = 0; i < RELAYS_COUNT; i++) {
+      if(i != master && relayRequested(i)) {
+        toggleRelay(i, SOURCE_INTERLOCK);
+      }
+    }
+  }
+
+#if FEATURE_MQTT
+  publishInterlock();
+#endif
+}
+
+// Reads the interlock sensor, returns true when the inhibit state changed
+bool sampleInterlock() {
+  lastInterlockSample = millis();
+
+  uint16_t value = (interlock.mode() == INTERLOCK_SWITCH ? digitalRead(PinInterlockSwitch) : analogRead(PinInterlockAnalog));
+  return interlock.update(value, lastInterlockSample);
+}
+
+// Pushes changed interlock configuration to the sensor logic. The sensor is read right away,
+// so neither boot nor a settings change opens a window for starts while it is raining.
+void applyInterlockSettings() {
+  bool wasActive = interlock.isActive();
+
+  if(!interlock.configure((InterlockMode)Config.interlock_mode, Config.interlock_active_low, Config.interlock_threshold, Config.interlock_hysteresis, INTERLOCK_SETTLE_TIME)) {
+    return;
+  }
+
+  if(Config.interlock_mode == INTERLOCK_SWITCH) {
+    pinMode(PinInterlockSwitch, INPUT_PULLUP);
+  }
+  if(Config.interlock_mode != INTERLOCK_NONE) {
+    sampleInterlock();
+  }
+
+  if(interlock.isActive() != wasActive) {
+    interlockChanged();
+  }
+}
+
+// Samples the interlock sensor, cheap enough to run on every loop() pass
+void processInterlock() {
+  if(interlock.mode() == INTERLOCK_NONE || (millis() - lastInterlockSample) < INTERLOCK_SAMPLE_INTERVAL) {
+    return;
+  }
+
+  if(sampleInterlock()) {
+    interlockChanged();
+  }
+}
+
+// Handles debounced button presses captured since the last call
+void processButtonEvents() {
+  uint8_t button;
+  uint32_t pressTime;
+  while(buttonEvents.nextPress(button, pressTime)) {
+    Log.printf("Button %i has been pressed.", button);
+    Log.println();
+
+    if(button < RELAYS_COUNT) {
+      toggleRelay(button, SOURCE_BUTTON);
+    }
+
+    unsigned long latency = micros() - pressTime;
+    unsigned int bucket = 0;
+    while(bucket < BUTTON_LATENCY_BUCKETS - 1 && latency >= BUTTON_LATENCY_BOUNDS[bucket] * 1000) {
+      bucket++;
+    }
+    buttonLatencyHistogram[bucket]++;
+    if(latency > buttonLatencyMax) {
+      buttonLatencyMax = latency;
+    }
+  }
+}
+
+#if FEATURE_MQTT
+// delay() replacement for blocking waits, keeps buttons responsive
+void delayProcessingButtons(unsigned long ms) {
+  unsigned long start = millis();
+  while((millis() - start) < ms) {
+    if(buttonEvents.pending()) {
+      processButtonEvents();
+    }
+    delay(10);
   }
 }
 
+// Payload is not null terminated
+bool mqttPayloadEquals(byte* payload, unsigned int length, const char *value) {
+  return length == strlen(value) && memcmp(payload, value, length) == 0;
+}
+
 void mqttSubscriptionCallback(char* topic, byte* payload, unsigned int length) {
+  unsigned long handlingStart = micros();
+  mqttStats.received++;
+
   // report to terminal for debug
-  Serial.print("[MQTT] Received message in topic '");
-  Serial.print(topic);
-  Serial.print("' with content: ");
-  for (uint i = 0; i < length; i++) {
-    Serial.print((char)payload[i]);
-  }
-  Serial.println();
+  Log.printf("[MQTT] Received message in topic '%s' with content: %.*s", topic, length, (char *)payload);
+  Log.println();
 
   for(int i = 0; i < RELAYS_COUNT; i++) {
     if (strcmp (mqttTopicRelayCommand[i].c_str(), topic) == 0 && length > 0) {
-      Serial.printf("[MQTT] State of relay %i requested to %c", (i + 1), payload[0]);
+      Log.printf("[MQTT] State of relay %i requested to %c", (i + 1), payload[0]);
 
       if(
-        ((payload[0] == '1' || (strcmp((char *)payload, "ON")  == 0) ) && relayState[i] == false) ||
-        ((payload[0] == '0' || (strcmp((char *)payload, "OFF") == 0) ) && relayState[i] == true)
+        ((payload[0] == '1' || mqttPayloadEquals(payload, length, "ON")) && relayRequested(i) == false) ||
+        ((payload[0] == '0' || mqttPayloadEquals(payload, length, "OFF")) && relayRequested(i) == true)
       ) {
-        Serial.printf(", current state %i differs -> toggle.", relayState[i]);
+        Log.printf(", current state %i differs -> toggle.", relayRequested(i));
        
-        toggleRelay(i);
+        // Interlock or the master zone may refuse the command
+        bool requested = relayRequested(i);
+        toggleRelay(i, SOURCE_MQTT);
+        if(relayRequested(i) != requested) {
+          mqttStats.applied++;
+        } else {
+          mqttStats.refused++;
+        }
       } else {
-        Serial.print(" already current state.");
+        Log.print(" already current state.");
+        mqttStats.unchanged++;
       }
 
-      Serial.println();
+      Log.println();
+
+      unsigned long handlingTime = micros() - handlingStart;
+      mqttStats.handlingTimeTotal += handlingTime;
+      if(handlingTime > mqttStats.handlingTimeMax) {
+        mqttStats.handlingTimeMax = handlingTime;
+      }
       return;
     }
   }
 
   // If we get here, we've not matched anything in loop above
-  Serial.println("[MQTT] No match for any action.");
+  Log.println("[MQTT] No match for any action.");
+  mqttStats.unmatched++;
+}
+
+// Publishes retained health record next to the LWT topic, kept short to fit the MQTT packet buffer
+void publishHealth() {
+  lastHealthReport = millis();
+
+  if(!mqttClient.connected()) {
+    return;
+  }
+
+  // Reset reason is a String and gets copied into the document
+  StaticJsonDocument<JSON_OBJECT_SIZE(10) + JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(RELAYS_COUNT) + 48> jsonDocument;
+
+  jsonDocument["reset"] = ESP.getResetReason();
+  jsonDocument["uptime"] = millis() / 1000;
+  jsonDocument["rssi"] = WiFi.RSSI();
+  jsonDocument["reconnects"] = (mqttStats.connections > 0 ? mqttStats.connections - 1 : 0);
+  jsonDocument["heap"] = ESP.getFreeHeap();
+  jsonDocument["maxBlock"] = ESP.getMaxFreeBlockSize();
+  jsonDocument["loopLagMax"] = loopLagMax;
+
+  JsonObject stall = jsonDocument.createNestedObject("stall");
+  stall["stage"] = LOOP_STAGE_NAMES[loopStallStage];
+  stall["time"] = loopStallMax;
+
+  JsonArray rejected = jsonDocument.createNestedArray("rejectedPulses");
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    rejected.add(meters[i].rejectedPulses());
+  }
+
+  String value;
+  serializeJson(jsonDocument, value);
+
+  mqttClient.publish(mqttHealthTopic.c_str(), value.c_str(), true);
 }
 
 void setupMqtt(int retries) { 
   if(mqttClient.connected()) {
-    Serial.println("[MQTT] Disconnecting...");
+    Log.println("[MQTT] Disconnecting...");
 
     // publish offline status to LWT (as when gracefully Disconnecting no LWT is sent)
     mqttClient.publish(mqttLwtTopic.c_str(), "Offline", true);
@@ -261,6 +1136,8 @@ void setupMqtt(int retries) {
   }
   
   mqttLwtTopic = String(Config.mqtt_channel_prefix + "status");
+  mqttHealthTopic = String(Config.mqtt_channel_prefix + "health");
+  mqttInterlockTopic = String(Config.mqtt_channel_prefix + "interlock");
   for(int i = 0; i < RELAYS_COUNT; i++) {
     // in MQTT relays are numbered starting with 1, not 0
     mqttTopicRelayStatus[i] = String(Config.mqtt_channel_prefix + (i + 1) + "/state");
@@ -284,23 +1161,25 @@ void setupMqtt(int retries) {
 
   int retryCount = 0;
   while (!mqttClient.connected() && retryCount < retries) {
-      Serial.printf("[MQTT] Connecting (retry %d of %d) with identity %s...", (retryCount + 1), retries, clientId);
-      Serial.println();
+      Log.printf("[MQTT] Connecting (retry %d of %d) with identity %s...", (retryCount + 1), retries, clientId);
+      Log.println();
   
       bool connectionState = false;
       connectionState = mqttClient.connect(clientId, mqtt_user, mqtt_password, mqttLwtTopic.c_str(), 1, true, "Offline");
       
       if (connectionState) {
-        Serial.println("[MQTT] Connected successfully.");  
+        Log.println("[MQTT] Connected successfully.");  
+
+        mqttStats.connections++;
 
         // publish online status to LWT
         mqttClient.publish(mqttLwtTopic.c_str(), "Online", true);
       } else {
-        Serial.print("[MQTT] Connection failed with code: ");
-        Serial.println(mqttClient.state());
+        Log.print("[MQTT] Connection failed with code: ");
+        Log.println(mqttClient.state());
 
         if(retryCount > 0) { // delay only if more retries are requested
-          delay(1000);
+          delayProcessingButtons(1000);
         }
       }
 
@@ -310,13 +1189,17 @@ void setupMqtt(int retries) {
   // And subscribe to respective channels
   if(mqttClient.connected()) {
     for(int i = 0; i < RELAYS_COUNT; i++) {
-      Serial.printf("[MQTT] Publishing current state of relay %d.\n", i);
+      Log.printf("[MQTT] Publishing current state of relay %d.\n", i);
       String value = String(relayState[i]);
       mqttClient.publish(mqttTopicRelayStatus[i].c_str(), value.c_str());
 
-      Serial.printf("[MQTT] Subscribing to the command channel: %s\n", mqttTopicRelayCommand[i].c_str());
+      Log.printf("[MQTT] Subscribing to the command channel: %s\n", mqttTopicRelayCommand[i].c_str());
       mqttClient.subscribe(mqttTopicRelayCommand[i].c_str());
     }
+
+    // Fresh record after boot and every reconnect
+    publishHealth();
+    publishInterlock();
   }
 
   lastMqttConnectionRetryTime = millis();
@@ -325,13 +1208,14 @@ void setupMqtt(int retries) {
 void reconnectMqtt() {
   setupMqtt(5); // By default try 5-times before gave up
 }
+#endif
 
 // Gets called when WiFiManager enters configuration mode
 void configModeCallback (WiFiManager *myWiFiManager) {
-  Serial.println("Entered config mode");
-  Serial.println(WiFi.softAPIP());
+  Log.println("Entered config mode");
+  Log.println(WiFi.softAPIP());
   //if you used auto generated SSID, print it
-  Serial.println(myWiFiManager->getConfigPortalSSID());
+  Log.println(myWiFiManager->getConfigPortalSSID());
   
   //entered config mode, make led toggle faster
   ticker.attach(0.2, tickStatusLed);
@@ -349,7 +1233,7 @@ char * millisToString(unsigned long millis) {
   return str;
 }
 
-#ifdef DEBUG_CONFIG
+#if FEATURE_WEB_SERVER && defined(DEBUG_CONFIG)
 void handle_configFile() {
   File configFile = getFile("/config.json");
   server.streamFile(configFile, "application/json");
@@ -357,6 +1241,7 @@ void handle_configFile() {
 }
 #endif
 
+#if FEATURE_WEB_UI
 void handle_cssFile() {
   File cssFile = getFile(CSS_FILE);
   server.streamFile(cssFile, "text/css");
@@ -368,13 +1253,17 @@ void handle_jsFile() {
   server.streamFile(jsFile, "text/css");
   jsFile.close();
 }
+#endif
 
+#if FEATURE_WEB_SERVER
 void handle_notFound() {
   server.send(404, "text/plain", "Not found");
 }
+#endif
 
+#if FEATURE_WEB_UI
 String generateSettingsHtml(){
-  Serial.println("[HTTP] Sending /config page.");
+  Log.println("[HTTP] Sending /config page.");
 
   String ptr = "<!DOCTYPE html> <html>\n";
   ptr += "<head><meta charset=\"UTF-8\"><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
@@ -406,9 +1295,93 @@ String generateSettingsHtml(){
       "  <tr>\n"
       "    <th>Timeout</th>\n"
       "    <td><input type=\"text\" name=\"relay_" + id + "_timeout\" value=\"" + (Config.relays[i].timeout) + "\"> min.<div class=\"small\">In minutes, 0 means no timeout.</div></td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Pulse filter</th>\n"
+      "    <td><input type=\"text\" name=\"relay_" + id + "_pulse_filter\" value=\"" + (Config.relays[i].pulseFilter) + "\"> &micro;s<div class=\"small\">Flow meter pulses closer than this are ignored as noise, 0 disables.</div></td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Flow window</th>\n"
+      "    <td><input type=\"text\" name=\"relay_" + id + "_meter_window\" value=\"" + (Config.relays[i].meterWindow) + "\"> ms<div class=\"small\">Flow meter sampling window, at least 100 ms.</div></td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Smoothing</th>\n"
+      "    <td><select name=\"relay_" + id + "_meter_smoothing\">"
+      "<option value=\"0\"" + (Config.relays[i].meterSmoothing == FLOW_SMOOTHING_NONE ? " selected" : "") + ">None</option>"
+      "<option value=\"1\"" + (Config.relays[i].meterSmoothing == FLOW_SMOOTHING_EWMA ? " selected" : "") + ">Exponential</option>"
+      "<option value=\"2\"" + (Config.relays[i].meterSmoothing == FLOW_SMOOTHING_AVERAGE ? " selected" : "") + ">Moving average</option>"
+      "</select> <input type=\"text\" name=\"relay_" + id + "_meter_smoothing_factor\" value=\"" + (Config.relays[i].meterSmoothingFactor) + "\" size=\"3\">"
+      "<div class=\"small\">Weight of the newest window in % for exponential, number of windows for moving average.</div></td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Report on</th>\n"
+      "    <td><select name=\"relay_" + id + "_meter_trigger\">"
+      "<option value=\"0\"" + (Config.relays[i].meterTrigger == FLOW_TRIGGER_FLOWING ? " selected" : "") + ">Every window with flow</option>"
+      "<option value=\"1\"" + (Config.relays[i].meterTrigger == FLOW_TRIGGER_CHANGE ? " selected" : "") + ">Change of flow rate</option>"
+      "<option value=\"2\"" + (Config.relays[i].meterTrigger == FLOW_TRIGGER_EDGES ? " selected" : "") + ">Start / stop only</option>"
+      "</select> <input type=\"text\" name=\"relay_" + id + "_meter_threshold\" value=\"" + (Config.relays[i].meterThreshold) + "\" size=\"3\"> %"
+      "<div class=\"small\">Change of flow rate needed to report a new reading.</div></td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Calibration</th>\n"
+      "    <td><input type=\"text\" name=\"relay_" + id + "_calibration\" value=\"" + calibrationToString(Config.relays[i]) + "\"><div class=\"small\">Pairs of frequency (Hz) and K-factor, e.g. <code>2:5.9;10:6.6</code>.</div></td>\n"
       "  </tr>\n";
   }
 
+  ptr += ""
+    "<tr>"
+    "<th colspan=\"2\" class=\"settings-cell\">Master Valve / Pump</th>"
+    "</tr>"
+    "  <tr>\n"
+    "    <th>Relay</th>\n"
+    "    <td><select name=\"master_relay\">"
+    "<option value=\"0\">None</option>";
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    ptr += "<option value=\"" + String(i + 1) + "\"" + (Config.master_relay == i + 1 ? " selected" : "") + ">" + Config.relays[i].name + "</option>";
+  }
+  ptr += ""
+    "</select><div class=\"small\">Opens before the first zone and closes after the last one.</div></td>\n"
+    "  </tr>\n"
+    "  <tr>\n"
+    "    <th>Lead time</th>\n"
+    "    <td><input type=\"text\" name=\"master_lead\" value=\"" + String(Config.master_lead) + "\"> ms<div class=\"small\">Delay between opening the master and the zone.</div></td>\n"
+    "  </tr>\n"
+    "  <tr>\n"
+    "    <th>Lag time</th>\n"
+    "    <td><input type=\"text\" name=\"master_lag\" value=\"" + String(Config.master_lag) + "\"> s<div class=\"small\">Delay between closing the last zone and the master.</div></td>\n"
+    "  </tr>\n";
+
+  ptr += ""
+    "<tr>"
+    "<th colspan=\"2\" class=\"settings-cell\">Rain / Soil Sensor</th>"
+    "</tr>"
+    "  <tr>\n"
+    "    <th>Sensor</th>\n"
+    "    <td><select name=\"interlock_mode\">"
+    "<option value=\"" + String(INTERLOCK_NONE) + "\"" + (Config.interlock_mode == INTERLOCK_NONE ? " selected" : "") + ">None</option>"
+    "<option value=\"" + String(INTERLOCK_SWITCH) + "\"" + (Config.interlock_mode == INTERLOCK_SWITCH ? " selected" : "") + ">Rain switch (SD3)</option>"
+    "<option value=\"" + String(INTERLOCK_ANALOG) + "\"" + (Config.interlock_mode == INTERLOCK_ANALOG ? " selected" : "") + ">Analog sensor (A0)</option>"
+    "</select><div class=\"small\">Blocks zone starts while it reports rain or wet soil. Current reading: " + String(interlock.value()) + ".</div></td>\n"
+    "  </tr>\n"
+    "  <tr>\n"
+    "    <th>Inhibit when</th>\n"
+    "    <td><select name=\"interlock_active_low\">"
+    "<option value=\"1\"" + (Config.interlock_active_low ? " selected" : "") + ">Reading is low</option>"
+    "<option value=\"0\"" + (!Config.interlock_active_low ? " selected" : "") + ">Reading is high</option>"
+    "</select><div class=\"small\">Closed rain switch reads low.</div></td>\n"
+    "  </tr>\n"
+    "  <tr>\n"
+    "    <th>Threshold</th>\n"
+    "    <td><input type=\"text\" name=\"interlock_threshold\" value=\"" + String(Config.interlock_threshold) + "\"> &plusmn; <input type=\"text\" name=\"interlock_hysteresis\" value=\"" + String(Config.interlock_hysteresis) + "\" size=\"3\"><div class=\"small\">Analog reading (0 - 1023) and hysteresis needed to release the block.</div></td>\n"
+    "  </tr>\n"
+    "  <tr>\n"
+    "    <th>Running zones</th>\n"
+    "    <td><select name=\"interlock_stop\">"
+    "<option value=\"0\"" + (!Config.interlock_stop ? " selected" : "") + ">Let finish</option>"
+    "<option value=\"1\"" + (Config.interlock_stop ? " selected" : "") + ">Stop</option>"
+    "</select></td>\n"
+    "  </tr>\n";
+
    ptr += ""
     "<tr>"
     "<th colspan=\"2\" class=\"settings-cell\">MQTT Settings</th>"
@@ -438,10 +1411,26 @@ String generateSettingsHtml(){
     "    <td><input type=\"text\" name=\"mqtt_channel_prefix\" value=\"" + (Config.mqtt_channel_prefix) + "\"></td>\n"
     "  </tr>\n"
 
+    "<tr>"
+    "<th colspan=\"2\" class=\"settings-cell\">Power Settings</th>"
+    "</tr>"
+    "  <tr>\n"
+    "    <th>Idle mode</th>\n"
+    "    <td><select name=\"power_save\">"
+    "<option value=\"0\"" + (Config.power_save == POWER_SAVE_NONE ? " selected" : "") + ">Disabled</option>"
+    "<option value=\"1\"" + (Config.power_save == POWER_SAVE_MODEM ? " selected" : "") + ">Modem sleep</option>"
+    "<option value=\"2\"" + (Config.power_save == POWER_SAVE_LIGHT ? " selected" : "") + ">Light sleep</option>"
+    "</select><div class=\"small\">Used when no zone is running.</div></td>\n"
+    "  </tr>\n"
+
     "  <tr>\n"
     "    <th class=\"settings-cell\" colspan=\"2\"><input class=\"button\" type=\"submit\" value=\"Save Changes\"></th>\n"
     "  </tr>\n"
 
+    "  <tr>\n"
+    "    <th class=\"settings-cell\" colspan=\"2\"><a href=\"/calibrate\" class=\"button\">Calibrate meters</a></th>\n"
+    "  </tr>\n"
+
     "  <tr>\n"
     "    <th class=\"settings-cell\" colspan=\"2\"><a href=\"/\" class=\"button\">Back</a></th>\n"
     "  </tr>\n"
@@ -452,39 +1441,270 @@ String generateSettingsHtml(){
   
   return ptr;
 }
+#endif
+
+#if FEATURE_WEB_API
+// Capacity of the /api/current document, computed from the number of zones
+#define API_CURRENT_CAPACITY (JSON_OBJECT_SIZE(3) + JSON_OBJECT_SIZE(1) + JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(RELAYS_COUNT) + RELAYS_COUNT * JSON_OBJECT_SIZE(7))
+
+// Sends the document straight into the socket through a small buffer, without building a String
+template<typename TDocument>
+void sendJson(int code, TDocument &jsonDocument) {
+  server.setContentLength(measureJson(jsonDocument));
+  server.send(code, "application/json", "");
+
+  WiFiClient client = server.client();
+  BufferedPrint<128> output(client);
+  serializeJson(jsonDocument, output);
+}
+
+// Changes whenever /api/current would return something else, remaining timeouts tick every second
+String currentStateETag() {
+  unsigned long version = stateVersion;
+  bool timerRunning = false;
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    version += meters[i].version();
+    timerRunning |= (relayTimeoutWhen[i] > 0);
+  }
+
+  String etag = "\"" + String(bootId, HEX) + "-" + String(version);
+  if(timerRunning) {
+    etag += "-" + String(millis() / 1000);
+  }
+  etag += "\"";
+
+  return etag;
+}
+
+void handle_api() {
+  String etag = currentStateETag();
+
+  // Clients may cache and revalidate, unchanged state is answered without body
+  server.sendHeader("Cache-Control", "no-cache");
+  server.sendHeader("ETag", etag);
+
+  if(server.header("If-None-Match") == etag) {
+    server.send(304, "application/json", "");
+    return;
+  }
 
-String generateJsonApiResponse() {
-   StaticJsonDocument<640> jsonDocument;
+  StaticJsonDocument<API_CURRENT_CAPACITY> jsonDocument;
+
+  JsonObject power = jsonDocument.createNestedObject("power");
+  power["state"] = powerStateName();
+
+  JsonObject interlockState = jsonDocument.createNestedObject("interlock");
+  interlockState["active"] = interlock.isActive();
+  interlockState["reason"] = interlock.reason();
+  interlockState["blocked"] = interlockBlocked;
   
   JsonArray relays = jsonDocument.createNestedArray("relays");
   for(int i = 0; i < RELAYS_COUNT; i++) {
     JsonObject relay = relays.createNestedObject();
     relay["timeout"] = 0;
-    if(Config.relays[i].timeout > 0 && relayTimeoutWhen[i] > 0) {
+    if(relayTimeoutWhen[i] > 0) {
       relay["timeout"] = (relayTimeoutWhen[i] - millis()) / 1000;
     }
     relay["state"] = relayState[i];
     relay["flowMilliLitres"] = meters[i].flowMilliLitres / 1000.0;
     relay["totalMilliLitres"] = meters[i].totalMilliLitres / 1000.0;
     relay["flowRate"] = meters[i].flowRate;
+    relay["rejectedPulses"] = meters[i].rejectedPulses();
   }
 
-  String json;
-  serializeJson(jsonDocument, json);
+  sendJson(200, jsonDocument);
+}
+
+// Time spent in power states, kept out of /api/current as it changes every second
+void handle_apiPower() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(3)> jsonDocument;
+
+  jsonDocument["state"] = powerStateName();
+  jsonDocument["active"] = powerStateSeconds(POWER_ACTIVE);
+  jsonDocument["idle"] = powerStateSeconds(POWER_IDLE);
 
-  return json;
+  server.sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  sendJson(200, jsonDocument);
 }
 
-void handle_api() {
+// Compact state of all relays, returned by the control API
+void sendRelaysState() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(1) + JSON_ARRAY_SIZE(RELAYS_COUNT) + RELAYS_COUNT * JSON_OBJECT_SIZE(4)> jsonDocument;
+
+  JsonArray relays = jsonDocument.createNestedArray("relays");
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    JsonObject relay = relays.createNestedObject();
+    relay["zone"] = i + 1;
+    relay["state"] = relayState[i] ? 1 : 0;
+    relay["timeout"] = (relayTimeoutWhen[i] > 0 ? (relayTimeoutWhen[i] - millis()) / 1000 : 0);
+    if(relayVolumeLimit[i] > 0) {
+      relay["volume"] = (relayVolumeLimit[i] - min(relayVolumeLimit[i], meters[i].totalMilliLitres)) / 1000.0;
+    }
+  }
+
+  server.sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  sendJson(200, jsonDocument);
+}
+
+// Longest run (s) accepted by the API, keeps the timer arithmetic in range
+#define API_MAX_DURATION (24L * 60 * 60)
+// Largest volume limit (L) accepted by the API, keeps the meter total plus limit within unsigned long ml
+#define API_MAX_VOLUME 100000.0
+
+struct RelayCommand {
+  int id;
+  bool state;
+  unsigned long duration; // s, 0 = configured timeout
+  float volume;           // L, 0 = no limit
+};
+
+// Parses state given as boolean, number or ON/OFF string
+bool parseRelayState(JsonVariant value, bool &state) {
+  if(value.is<bool>()) {
+    state = value.as<bool>();
+  } else if(value.is<int>()) {
+    state = value.as<int>() != 0;
+  } else if(value.is<const char*>()) {
+    const char *text = value.as<const char*>();
+    if(strcmp(text, "ON") == 0 || strcmp(text, "1") == 0) {
+      state = true;
+    } else if(strcmp(text, "OFF") == 0 || strcmp(text, "0") == 0) {
+      state = false;
+    } else {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  return true;
+}
+
+void handle_apiRelays() {
+  // strings from the request body are copied into the document, keep room for them
+  StaticJsonDocument<JSON_ARRAY_SIZE(RELAYS_COUNT) + RELAYS_COUNT * (JSON_OBJECT_SIZE(4) + 32) + 64> json;
+  DeserializationError error = deserializeJson(json, server.arg("plain"));
+  if(error || !json.is<JsonArray>()) {
+    server.send(400, "application/json", "{\"error\":\"Body has to be JSON array of commands.\"}");
+    return;
+  }
+
+  // Validate everything first, so the batch is applied either whole or not at all
+  RelayCommand commands[RELAYS_COUNT];
+  bool zoneSeen[RELAYS_COUNT] = {};
+  int count = 0;
+  for(JsonObject command : json.as<JsonArray>()) {
+    if(count >= RELAYS_COUNT) {
+      server.send(400, "application/json", "{\"error\":\"Too many commands.\"}");
+      return;
+    }
+
+    int zone = command["zone"] | 0;
+    if(zone < 1 || zone > RELAYS_COUNT) {
+      server.send(400, "application/json", "{\"error\":\"Invalid zone.\"}");
+      return;
+    }
+    if(zone - 1 == masterRelay()) {
+      server.send(400, "application/json", "{\"error\":\"Zone is the master valve, it is switched automatically.\"}");
+      return;
+    }
+    if(zoneSeen[zone - 1]) {
+      server.send(400, "application/json", "{\"error\":\"Zone is repeated in the batch.\"}");
+      return;
+    }
+    zoneSeen[zone - 1] = true;
+
+    long duration = command["duration"] | 0L;
+    if(duration < 0 || duration > API_MAX_DURATION) {
+      server.send(400, "application/json", "{\"error\":\"Invalid duration.\"}");
+      return;
+    }
+
+    RelayCommand &relayCommand = commands[count++];
+    relayCommand.id = zone - 1;
+    relayCommand.duration = duration;
+    relayCommand.volume = command["volume"] | 0.0;
+
+    if(!parseRelayState(command["state"], relayCommand.state) || !(relayCommand.volume >= 0 && relayCommand.volume <= API_MAX_VOLUME)) {
+      server.send(400, "application/json", "{\"error\":\"Invalid state or volume.\"}");
+      return;
+    }
+  }
+
+  for(int i = 0; i < count; i++) {
+    RelayCommand &command = commands[i];
+
+    Log.printf("[API] Setting relay %i to %i.", command.id, command.state);
+    Log.println();
+
+    // Limits go with the start, which may be delayed by the master valve or refused by the interlock
+    setRelay(command.id, command.state, SOURCE_API, command.duration, (unsigned long)(command.volume * 1000));
+  }
+
+  sendRelaysState();
+}
+
+// Finished irrigation sessions, newest first
+void handle_apiSessions() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(2) + JSON_ARRAY_SIZE(SESSIONS_HISTORY) + SESSIONS_HISTORY * JSON_OBJECT_SIZE(8)> jsonDocument;
+
+  jsonDocument["uptime"] = millis() / 1000;
+  JsonArray sessions = jsonDocument.createNestedArray("sessions");
+  for(int i = 1; i <= sessionsHistoryCount; i++) {
+    serializeSession(sessionsHistory[(sessionsHistoryNext + SESSIONS_HISTORY - i) % SESSIONS_HISTORY], sessions.createNestedObject());
+  }
+
+  server.sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  sendJson(200, jsonDocument);
+}
+
+// Button queue health and press to relay latency histogram
+void handle_apiButtons() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(3) + JSON_ARRAY_SIZE(BUTTON_LATENCY_BUCKETS) + BUTTON_LATENCY_BUCKETS * JSON_OBJECT_SIZE(2)> jsonDocument;
+
+  jsonDocument["dropped"] = buttonEvents.dropped();
+  jsonDocument["latencyMax"] = buttonLatencyMax;
+
+  JsonArray latency = jsonDocument.createNestedArray("latency");
+  for(unsigned int i = 0; i < BUTTON_LATENCY_BUCKETS; i++) {
+    JsonObject bucket = latency.createNestedObject();
+    if(i < BUTTON_LATENCY_BUCKETS - 1) {
+      bucket["below"] = BUTTON_LATENCY_BOUNDS[i];
+    }
+    bucket["count"] = buttonLatencyHistogram[i];
+  }
+
   server.sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
-  server.sendHeader("Pragma", "no-cache");
-  server.sendHeader("Expires", "-1");
+  sendJson(200, jsonDocument);
+}
+
+#if FEATURE_MQTT
+// MQTT command path statistics
+void handle_apiMqtt() {
+  StaticJsonDocument<JSON_OBJECT_SIZE(10)> jsonDocument;
 
-  server.send(200, "application/json", generateJsonApiResponse()); 
+  unsigned long handled = mqttStats.applied + mqttStats.unchanged + mqttStats.refused;
+
+  jsonDocument["connected"] = mqttClient.connected();
+  jsonDocument["received"] = mqttStats.received;
+  jsonDocument["applied"] = mqttStats.applied;
+  jsonDocument["unchanged"] = mqttStats.unchanged;
+  jsonDocument["refused"] = mqttStats.refused;
+  jsonDocument["unmatched"] = mqttStats.unmatched;
+  jsonDocument["reconnects"] = (mqttStats.connections > 0 ? mqttStats.connections - 1 : 0);
+  jsonDocument["handlingTimeAverage"] = (handled > 0 ? mqttStats.handlingTimeTotal / handled : 0);
+  jsonDocument["handlingTimeMax"] = mqttStats.handlingTimeMax;
+  jsonDocument["loopLagMax"] = loopLagMax;
+
+  server.sendHeader("Cache-Control", "no-cache, no-store, must-revalidate");
+  sendJson(200, jsonDocument);
 }
+#endif
+#endif
 
+#if FEATURE_WEB_UI
 String generateHomepageHtml(){
-  Serial.println("[HTTP] Sending homepage.");
+  Log.println("[HTTP] Sending homepage.");
 
   String ptr = "<!DOCTYPE html> <html>\n";
   ptr += "<head><meta charset=\"UTF-8\"><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
@@ -495,7 +1715,7 @@ String generateHomepageHtml(){
   ptr += "<script type=\"text/javascript\">\n"
          "  window.onload = function () {\n";
   for(int i = 0; i < RELAYS_COUNT; i++) {
-    if(Config.relays[i].timeout > 0 && relayTimeoutWhen[i] > 0) {
+    if(relayTimeoutWhen[i] > 0) {
       unsigned long remainingSecondsTimer = (relayTimeoutWhen[i] - millis()) / 1000;
       ptr += "    updateRelayCountdown(" + String(i) + ", " + String(remainingSecondsTimer) + ");\n";
     }
@@ -510,6 +1730,10 @@ String generateHomepageHtml(){
   ptr += "</head>\n";
   ptr += "<body>\n<div class=\"page\">";
   ptr += "<h1>Irrigation</h1>\n";
+
+  if(interlock.isActive()) {
+    ptr += "<div class=\"alert-box\">Irrigation is blocked by the " + String(interlock.mode() == INTERLOCK_SWITCH ? "rain" : "soil moisture") + " sensor.</div>\n";
+  }
   
   ptr += "<div class='row valve-row'>\n";
 
@@ -623,6 +1847,32 @@ void handle_saveConfig() {
     channel += "/";
   Config.mqtt_channel_prefix = channel;
 
+  arg = server.arg("power_save");
+  Config.power_save = constrain((int)arg.toInt(), POWER_SAVE_NONE, POWER_SAVE_LIGHT);
+
+  // Do not leave the previous master valve open when the role moves
+  int previousMaster = masterRelay();
+  Config.master_relay = constrain((int)server.arg("master_relay").toInt(), 0, RELAYS_COUNT);
+  if(previousMaster >= 0 && previousMaster != masterRelay() && relayState[previousMaster]) {
+    masterClosePending = false;
+    writeRelay(previousMaster, false);
+  }
+
+  // Limits of a zone which became the master would never be cleared by toggling it
+  if(masterRelay() >= 0) {
+    relayTimeoutWhen[masterRelay()] = 0;
+    relayVolumeLimit[masterRelay()] = 0;
+  }
+
+  Config.master_lead = max(0, (int)server.arg("master_lead").toInt());
+  Config.master_lag = max(0, (int)server.arg("master_lag").toInt());
+
+  Config.interlock_mode = constrain((int)server.arg("interlock_mode").toInt(), (int)INTERLOCK_NONE, (int)INTERLOCK_ANALOG);
+  Config.interlock_active_low = server.arg("interlock_active_low") != "0";
+  Config.interlock_threshold = constrain((int)server.arg("interlock_threshold").toInt(), 0, 1023);
+  Config.interlock_hysteresis = constrain((int)server.arg("interlock_hysteresis").toInt(), 0, 1023);
+  Config.interlock_stop = server.arg("interlock_stop") == "1";
+
   for(int i = 0; i < RELAYS_COUNT; i++) {
     arg = server.arg("relay_" + String(i) + "_timeout");
     arg.trim();
@@ -631,23 +1881,191 @@ void handle_saveConfig() {
     arg = server.arg("relay_" + String(i) + "_name");
     arg.trim();
     Config.relays[i].name = arg;
+
+    arg = server.arg("relay_" + String(i) + "_pulse_filter");
+    arg.trim();
+    Config.relays[i].pulseFilter = (arg.length() == 0 ? DEFAULT_PULSE_FILTER : max(0, (int)arg.toInt()));
+
+    arg = server.arg("relay_" + String(i) + "_meter_window");
+    arg.trim();
+    Config.relays[i].meterWindow = (arg.length() == 0 ? 1000 : max(100, (int)arg.toInt()));
+
+    Config.relays[i].meterSmoothing = constrain((int)server.arg("relay_" + String(i) + "_meter_smoothing").toInt(), (int)FLOW_SMOOTHING_NONE, (int)FLOW_SMOOTHING_AVERAGE);
+    Config.relays[i].meterSmoothingFactor = max(0, (int)server.arg("relay_" + String(i) + "_meter_smoothing_factor").toInt());
+    Config.relays[i].meterTrigger = constrain((int)server.arg("relay_" + String(i) + "_meter_trigger").toInt(), (int)FLOW_TRIGGER_FLOWING, (int)FLOW_TRIGGER_EDGES);
+
+    arg = server.arg("relay_" + String(i) + "_meter_threshold");
+    arg.trim();
+    Config.relays[i].meterThreshold = (arg.length() == 0 ? DEFAULT_FLOW_CHANGE_THRESHOLD : max(0, (int)arg.toInt()));
+
+    arg = server.arg("relay_" + String(i) + "_calibration");
+    arg.trim();
+    calibrationFromString(Config.relays[i], arg);
   }
 
-  saveConfigurationFile();
+  requestConfigurationSave();
+  applyMeterSettings();
+  applyInterlockSettings();
 
+#if FEATURE_MQTT
   // Reconnect MQTT to reflect changes
   reconnectMqtt();
+#endif
 
   server.sendHeader("Location", "/config?saved=1", true);
   server.send(303, "text/plain"); 
 }
 
+String generateCalibrationHtml() {
+  Log.println("[HTTP] Sending /calibrate page.");
+
+  String ptr = "<!DOCTYPE html> <html>\n";
+  ptr += "<head><meta charset=\"UTF-8\"><meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0, user-scalable=no\">\n";
+  ptr += "<title>Irrigation / Calibration</title>\n";
+  ptr += "<link href=\"/style.css\" type=\"text/css\" rel=\"stylesheet\"/>\n";
+  ptr += "</head>\n";
+  ptr += "<body><div class=\"page\">\n";
+  ptr += "<h1>Irrigation</h1>\n";
+  ptr += "<h2>Flow meter calibration</h2>\n";
+  ptr += "<p>Start the run, let a known volume of water through the zone (e.g. into a bucket), stop the run and enter the measured volume.</p>\n";
+
+  if(server.hasArg("saved")) {
+    ptr += "<div class=\"alert-box\">Calibration point was added.</div>";
+  }
+  if(server.hasArg("failed")) {
+    ptr += "<div class=\"alert-box\">Calibration failed, no pulses were counted or volume is invalid.</div>";
+  }
+  if(server.hasArg("refused")) {
+    ptr += "<div class=\"alert-box\">Zone did not start (master valve or rain / soil interlock), calibration was not started.</div>";
+  }
+
+  ptr += "<table>\n";
+  for(int i = 0; i < RELAYS_COUNT; i++) {
+    String id = String(i);
+
+    ptr += ""
+      "  <tr>\n"
+      "    <th colspan=\"2\" class=\"settings-cell\">" + Config.relays[i].name + "</th>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <th>Curve</th>\n"
+      "    <td>" + calibrationToString(Config.relays[i]) + "</td>\n"
+      "  </tr>\n"
+      "  <tr>\n"
+      "    <td colspan=\"2\" class=\"settings-cell\">"
+      "<form method=\"post\" enctype=\"application/x-www-form-urlencoded\">"
+      "<input type=\"hidden\" name=\"id\" value=\"" + id + "\">";
+
+    if(meters[i].isCalibrating() || calibrationPending[i]) {
+      ptr += ""
+        "<input type=\"hidden\" name=\"action\" value=\"stop\">"
+        "<input class=\"button\" type=\"submit\" value=\"Stop run\">";
+    } else if(meters[i].isCalibrationStopped()) {
+      ptr += ""
+        "<input type=\"hidden\" name=\"action\" value=\"finish\">"
+        "<input type=\"text\" name=\"litres\" value=\"\"> L<div class=\"small\">Measured volume in litres.</div>"
+        "<input class=\"button\" type=\"submit\" value=\"Save point\">";
+    } else {
+      ptr += ""
+        "<input type=\"hidden\" name=\"action\" value=\"start\">"
+        "<input class=\"button\" type=\"submit\" value=\"Start run\">";
+    }
+
+    ptr += "</form></td>\n"
+      "  </tr>\n";
+  }
+
+  ptr += ""
+    "  <tr>\n"
+    "    <th class=\"settings-cell\" colspan=\"2\"><a href=\"/config\" class=\"button\">Back</a></th>\n"
+    "  </tr>\n"
+    "</table>\n"
+    "</div></body>\n"
+    "</html>\n";
+
+  return ptr;
+}
+
+void handle_pageCalibrate() {
+  server.send(200, "text/html", generateCalibrationHtml());
+}
+
+void handle_calibrate() {
+  int id = server.arg("id").toInt();
+  if(!server.hasArg("id") || id < 0 || id >= RELAYS_COUNT) {
+    server.send(400, "text/html", "Invalid ID of relay was sent.");
+    return;
+  }
+
+  String location = "/calibrate";
+
+  if(server.arg("action") == "start") {
+    Log.printf("[CALIBRATION] Starting calibration run of meter %i.", id);
+    Log.println();
+
+    // Run starts with the valve, which may wait for the master or be refused
+    if(relayState[id]) {
+      meters[id].startCalibration();
+    } else {
+      calibrationPending[id] = true;
+      if(!relayStartPending[id]) {
+        toggleRelay(id, SOURCE_CALIBRATION);
+      }
+    }
+
+    if(!relayRequested(id)) {
+      Log.printf("[CALIBRATION] Zone %i did not start, calibration refused.", id);
+      Log.println();
+
+      calibrationPending[id] = false;
+      location += "?refused=1";
+    }
+  } else if(server.arg("action") == "stop") {
+    Log.printf("[CALIBRATION] Stopping calibration run of meter %i.", id);
+    Log.println();
+
+    // Freeze pulses and time first, the volume is entered after reading the bucket
+    calibrationPending[id] = false;
+    meters[id].stopCalibration();
+    if(relayRequested(id)) {
+      toggleRelay(id, SOURCE_CALIBRATION);
+    }
+  } else {
+    float frequency, factor;
+    String arg = server.arg("litres");
+    arg.trim();
+    arg.replace(",", ".");
+
+    if(meters[id].finishCalibration(arg.toFloat(), frequency, factor)) {
+      Log.printf("[CALIBRATION] Meter %i measured K-factor %.3f at %.2f Hz.", id, factor, frequency);
+      Log.println();
+
+      fitCalibrationPoint(Config.relays[id], frequency, factor);
+      requestConfigurationSave();
+      applyMeterSettings();
+
+      location += "?saved=1";
+    } else {
+      location += "?failed=1";
+    }
+  }
+
+  server.sendHeader("Location", location, true);
+  server.send(303, "text/plain");
+}
+
 void handle_homepage() {
   server.send(200, "text/html", generateHomepageHtml()); 
 }
 
 void handle_restart() {
   server.send(200, "text/html", "<strong>Restarting the device...</strong>"); 
+
+  // Do not lose pending changes
+  if(configSaveRequested) {
+    saveConfigurationFile();
+  }
+
   delay(200);
   ESP.restart();
 }
@@ -664,70 +2082,54 @@ void handle_toggle() {
     return;
   }
 
-  toggleRelay(id);
+  toggleRelay(id, SOURCE_WEB);
 
   server.sendHeader("Location", "/");
   server.send(303, "text/plain");
 }
+#endif
 
-// Callback function to be called when the button is pressed.
-void onPressed0() {
-	Serial.println("Button 0 has been pressed.");
-  
-  toggleRelay(0);
+// Button interrupts, only queue the edge
+void ICACHE_RAM_ATTR button0_changed() {
+  buttonEvents.push(0, digitalRead(PinButton1));
 }
 
-void onPressed1() {
-	Serial.println("Button 1 has been pressed.");
-  
-  toggleRelay(1);
+void ICACHE_RAM_ATTR button1_changed() {
+  buttonEvents.push(1, digitalRead(PinButton2));
 }
 
 void ICACHE_RAM_ATTR meter0_triggered() {
   meters[0].counter();
 
-  //Serial.printf("[FLOW] Flow meter 1 triggered, current counter = %d", meters[0]._pulseCounter);
-  //Serial.println();
+  //Log.printf("[FLOW] Flow meter 1 triggered, current counter = %d", meters[0]._pulseCounter);
+  //Log.println();
 }
 void ICACHE_RAM_ATTR meter1_triggered() {
   meters[1].counter();
 
-  //Serial.printf("[FLOW] Flow meter 2 triggered, current counter = %d", meters[1]._pulseCounter);
-  //Serial.println();
+  //Log.printf("[FLOW] Flow meter 2 triggered, current counter = %d", meters[1]._pulseCounter);
+  //Log.println();
 }
 
-void meter_flowChanged(uint8_t pin) {
-  int meterIndex = 0;
-  bool meterFound = false;
-  for(meterIndex = 0; meterIndex < RELAYS_COUNT; meterIndex++) {
+int meterIndexForPin(uint8_t pin) {
+  for(int meterIndex = 0; meterIndex < RELAYS_COUNT; meterIndex++) {
     if(METER_PINS[meterIndex] == pin) {
-      meterFound = true;
-      break;
+      return meterIndex;
     }
   }
 
-  if(!meterFound) {
-    Serial.printf("[FLOW] Unable to find meter index for PIN %d", pin);
-    Serial.println();
-
-    return;
-  }
-
-  if(meters[meterIndex].flowRate > 0) {
-    // Print the flow rate for this second in litres / minute
-    Serial.printf("[Valve %i] Flow rate: %.2f L/min", meterIndex, meters[meterIndex].flowRate);
-
-    // Print the number of litres flowed in this second
-    Serial.printf("  Current Liquid Flowing: %d mL/sec", meters[meterIndex].flowMilliLitres); // Output separator
+  Log.printf("[FLOW] Unable to find meter index for PIN %d", pin);
+  Log.println();
 
-    // Print the cumulative total of litres flowed since starting
-    Serial.printf("  Output Liquid Quantity: %lu mL", meters[meterIndex].totalMilliLitres); // Output separator
-    Serial.println();
-  }
+  return -1;
+}
 
-  if(mqttClient.connected() && ((millis() - lastFlowMeterUpdate[meterIndex]) > FLOW_REPORT_INTERVAL)) {
-    Serial.printf("[Valve %i] Reporting to MQTT", meterIndex);
-    Serial.println();
+// Publishes current readings of the meter via MQTT
+void reportFlow(int meterIndex) {
+#if FEATURE_MQTT
+  if(mqttClient.connected()) {
+    Log.printf("[Valve %i] Reporting to MQTT", meterIndex);
+    Log.println();
 
     String channelCurrent = String(Config.mqtt_channel_prefix + (meterIndex + 1) + "/currentFlow");
     String valueCurrent = String(meters[meterIndex].flowRate);
@@ -736,8 +2138,66 @@ void meter_flowChanged(uint8_t pin) {
     String channelTotal = String(Config.mqtt_channel_prefix + (meterIndex + 1) + "/totalFlow");
     String valueTotal = String(meters[meterIndex].totalMilliLitres);
     mqttClient.publish(channelTotal.c_str(), valueTotal.c_str());
+  }
+#endif
+
+  lastFlowMeterUpdate[meterIndex] = millis();
+}
+
+void publishFlowing(int meterIndex, bool flowing) {
+  Log.printf("[Valve %i] Flow %s.", meterIndex, flowing ? "started" : "stopped");
+  Log.println();
+
+#if FEATURE_MQTT
+  if(mqttClient.connected()) {
+    String channel = String(Config.mqtt_channel_prefix + (meterIndex + 1) + "/flowing");
+    mqttClient.publish(channel.c_str(), flowing ? "1" : "0");
+  }
+#endif
+}
+
+void meter_flowStarted(uint8_t pin) {
+  int meterIndex = meterIndexForPin(pin);
+  if(meterIndex < 0) {
+    return;
+  }
+
+  publishFlowing(meterIndex, true);
+}
+
+void meter_flowStopped(uint8_t pin) {
+  int meterIndex = meterIndexForPin(pin);
+  if(meterIndex < 0) {
+    return;
+  }
+
+  publishFlowing(meterIndex, false);
+
+  // Final readings right away, periodic reports end with the flow
+  reportFlow(meterIndex);
+}
+
+void meter_flowChanged(uint8_t pin) {
+  int meterIndex = meterIndexForPin(pin);
+  if(meterIndex < 0) {
+    return;
+  }
 
-    lastFlowMeterUpdate[meterIndex] = millis();
+  if(meters[meterIndex].flowRate > 0) {
+    // Print the flow rate for this window in litres / minute
+    Log.printf("[Valve %i] Flow rate: %.2f L/min", meterIndex, meters[meterIndex].flowRate);
+
+    // Print the number of litres flowed in this window
+    Log.printf("  Current Liquid Flowing: %d mL", meters[meterIndex].flowMilliLitres); // Output separator
+
+    // Print the cumulative total of litres flowed since starting
+    Log.printf("  Output Liquid Quantity: %lu mL", meters[meterIndex].totalMilliLitres); // Output separator
+    Log.println();
+  }
+
+  // Reading selected by the meter's report rule, the final one after flow stopped is sent by meter_flowStopped
+  if(meters[meterIndex].isFlowing()) {
+    reportFlow(meterIndex);
   }
 }
 
@@ -746,15 +2206,20 @@ void setup() {
   //SPIFFS.format();
   //WiFiManager.reset();
 
+#if FEATURE_LOGGING
   // Set serial console Baud rate
   Serial.begin(115200);
+#endif
+
+  // Hardware random number generator
+  bootId = ESP.random();
 
-  // Initialize the buttons
-	buttons[0].begin();
-  buttons[0].onPressed(onPressed0);
+  // Initialize the buttons, pressed button pulls the pin to ground
+  pinMode(PinButton1, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(PinButton1), button0_changed, CHANGE);
   
-  buttons[1].begin();
-  buttons[1].onPressed(onPressed1);
+  pinMode(PinButton2, INPUT_PULLUP);
+  attachInterrupt(digitalPinToInterrupt(PinButton2), button1_changed, CHANGE);
 	
   // Initialize GPIO PINs
   pinMode(PinLed1, OUTPUT);
@@ -769,6 +2234,8 @@ void setup() {
   meters[1].begin(meter1_triggered);
   for(int i = 0; i < RELAYS_COUNT; i++) {
     meters[i].onFlowChanged(meter_flowChanged);
+    meters[i].onFlowStarted(meter_flowStarted);
+    meters[i].onFlowStopped(meter_flowStopped);
   }
 
   // !!! using internal LED (LED_BUILTIN) blocks internal TTY output !!! On-board LED je připojena mezi TX1 = GPIO2 a VCC 
@@ -783,7 +2250,7 @@ void setup() {
   wifiManager.setConfigPortalTimeout(120);
   
   if(!wifiManager.autoConnect("Zavlazovac-Setup")) {
-      Serial.println("failed to connect and hit timeout");
+      Log.println("failed to connect and hit timeout");
       delay(3000);
 
       // Reset and try again, or maybe put it to deep sleep
@@ -801,35 +2268,84 @@ void setup() {
 
   // Init values from file system
   if (SPIFFS.begin()) {
-    Serial.println("File system is mounted.");
+    Log.println("File system is mounted.");
 
     readConfigurationFile();
   }
+  applyMeterSettings();
+  applyInterlockSettings();
 
+  // Radio stays awake while active, idle mode switches to the configured sleep type
+  if(Config.power_save != POWER_SAVE_NONE) {
+    WiFi.setSleepMode(WIFI_NONE_SLEEP);
+  }
+
+#if FEATURE_MQTT
   // Reconnect MQTT if needed
   reconnectMqtt();
+#endif
 
+#if FEATURE_WEB_SERVER
   // Web server pages
+#if FEATURE_WEB_UI
   server.on("/", handle_homepage);
   server.on("/config", HTTP_GET, handle_pageConfig);
   server.on("/config", HTTP_POST, handle_saveConfig);
-  server.on("/api/current", handle_api);
+  server.on("/calibrate", HTTP_GET, handle_pageCalibrate);
+  server.on("/calibrate", HTTP_POST, handle_calibrate);
   server.on("/restart", handle_restart);
   server.on("/toggle", handle_toggle);
   server.on("/style.css", handle_cssFile);
+  server.on("/scripts.js", handle_jsFile);
+#endif
+#if FEATURE_WEB_API
+  server.on("/api/current", handle_api);
+  server.on("/api/power", handle_apiPower);
+  server.on("/api/relays", HTTP_POST, handle_apiRelays);
+  server.on("/api/sessions", handle_apiSessions);
+  server.on("/api/buttons", handle_apiButtons);
+#if FEATURE_MQTT
+  server.on("/api/mqtt", handle_apiMqtt);
+#endif
+#endif
   #ifdef DEBUG_CONFIG
   server.on("/config.json", handle_configFile);
   #endif
-  server.on("/scripts.js", handle_jsFile);
   server.onNotFound(handle_notFound);  
+
+#if FEATURE_WEB_API
+  // Request headers are dropped unless asked for
+  const char *collectedHeaders[] = { "If-None-Match" };
+  server.collectHeaders(collectedHeaders, 1);
+#endif
+
   server.begin();
-  Serial.println("[HTTP] Server started.");
+  Log.println("[HTTP] Server started.");
+#endif
+}
+
+// Records how long the loop stage took when it is the longest so far, returns the time the stage ended
+unsigned long endLoopStage(LoopStage stage, unsigned long stageStart) {
+  unsigned long now = micros();
+  if(now - stageStart > loopStallMax) {
+    loopStallMax = now - stageStart;
+    loopStallStage = stage;
+  }
+
+  return now;
 }
 
 void loop() {
+  unsigned long loopStart = micros();
+  unsigned long stageStart = loopStart;
+
+#if FEATURE_WEB_SERVER
   // Process web server requests
   server.handleClient();
+  stageStart = endLoopStage(STAGE_HTTP, stageStart);
+#endif
   
+#if FEATURE_MQTT
   // MQTT reconnect if no connection with non-blocking delay
   if(!mqttClient.connected() && ((millis() - lastMqttConnectionRetryTime) > mqttReconnectDelay)) {
     setupMqtt(1);
@@ -837,18 +2353,70 @@ void loop() {
   
   // Process MQTT communication
   mqttClient.loop();
+
+  if(millis() - lastHealthReport > HEALTH_REPORT_INTERVAL) {
+    publishHealth();
+  }
+  stageStart = endLoopStage(STAGE_MQTT, stageStart);
+#endif
+
+  // Persist configuration changes once they settle
+  if(configSaveRequested && (millis() - configSaveRequestedTime) > CONFIG_SAVE_DELAY) {
+    saveConfigurationFile();
+  }
+  stageStart = endLoopStage(STAGE_CONFIG, stageStart);
   
-  for(int i = 0; i < RELAYS_COUNT; i++) {
-    // Continuously read the status of the button. 
-    buttons[i].read();
+  // Button presses captured by interrupts
+  if(buttonEvents.pending()) {
+    processButtonEvents();
+  }
+  stageStart = endLoopStage(STAGE_BUTTONS, stageStart);
+
+  // Master valve / pump timing
+  processMasterSequence();
+  stageStart = endLoopStage(STAGE_MASTER, stageStart);
 
+  // Rain / soil sensor
+  processInterlock();
+  stageStart = endLoopStage(STAGE_INTERLOCK, stageStart);
+  
+  for(int i = 0; i < RELAYS_COUNT; i++) {
     // process flow meters
     meters[i].loop();
 
+    // Track peak flow of the running session, independent of the report rule
+    if(relayState[i] && meters[i].flowRate > activeSessions[i].peakFlow) {
+      activeSessions[i].peakFlow = meters[i].flowRate;
+    }
+
+    // Readings not reported for a while are repeated while water flows, except for start / stop only reporting
+    if(meters[i].isFlowing() && Config.relays[i].meterTrigger != FLOW_TRIGGER_EDGES && (millis() - lastFlowMeterUpdate[i]) > FLOW_REPORT_INTERVAL) {
+      reportFlow(i);
+    }
+
     // Process relay timeouts
-    if(Config.relays[i].timeout > 0 && relayTimeoutWhen[i] > 0 && relayTimeoutWhen[i] < millis()) {
-      Serial.println("Configured timeout for relay 1 exceeded -> toggling");
-      toggleRelay(i);
+    if(relayTimeoutWhen[i] > 0 && relayTimeoutWhen[i] < millis()) {
+      Log.println("Configured timeout for relay 1 exceeded -> toggling");
+      toggleRelay(i, SOURCE_TIMEOUT);
+    }
+
+    // Process relay volume limits
+    if(relayVolumeLimit[i] > 0 && meters[i].totalMilliLitres >= relayVolumeLimit[i]) {
+      Log.printf("[RELAY] Requested volume for relay %i delivered -> toggling", i);
+      Log.println();
+      toggleRelay(i, SOURCE_VOLUME);
     }
   }
+  endLoopStage(STAGE_METERS, stageStart);
+
+  unsigned long loopTime = micros() - loopStart;
+  if(loopTime > loopLagMax) {
+    loopLagMax = loopTime;
+  }
+
+  // With nothing to do let the chip sleep for a moment instead of spinning
+  setPowerState(canIdle() ? POWER_IDLE : POWER_ACTIVE);
+  if(powerState == POWER_IDLE) {
+    delay(IDLE_LOOP_DELAY);
+  }
 }
@@ -0,0 +1,351 @@
+// Host shim of the Arduino / ESP8266 core, just enough to build and run the firmware in the
+// native environment. Time runs on the host clock, delay() only moves it forward, so idle
+// pauses cost nothing. GPIO levels are kept in memory and every output change is recorded.
+#pragma once
+
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+typedef bool boolean;
+typedef uint8_t byte;
+typedef unsigned int uint;
+
+#define ICACHE_RAM_ATTR
+#define IRAM_ATTR
+#define PROGMEM
+#define F(string) (string)
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0x00
+#define OUTPUT 0x01
+#define INPUT_PULLUP 0x02
+#define RISING 0x01
+#define FALLING 0x02
+#define CHANGE 0x03
+
+#define DEC 10
+#define HEX 16
+
+// NodeMCU pin names
+#define D0 16
+#define D1 5
+#define D2 4
+#define D3 0
+#define D4 2
+#define D5 14
+#define D6 12
+#define D7 13
+#define D8 15
+#define SD3 10
+#define A0 17
+
+#define SHIM_PINS 18
+
+#define clockCyclesPerMicrosecond() (80U)
+#define microsecondsToClockCycles(a) ((a) * clockCyclesPerMicrosecond())
+
+template<typename A, typename B> auto min(A a, B b) -> decltype(a < b ? a : b) { return b < a ? b : a; }
+template<typename A, typename B> auto max(A a, B b) -> decltype(a < b ? a : b) { return a < b ? b : a; }
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+namespace shim {
+
+struct PinChange {
+    uint8_t pin;
+    uint8_t level;
+    unsigned long time; // micros()
+};
+
+struct State {
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    unsigned long skipped = 0; // us added by delay()
+    uint8_t mode[SHIM_PINS] = {};
+    uint8_t level[SHIM_PINS] = {};
+    uint16_t analog = 0;
+    void (*isr[SHIM_PINS])(void) = {};
+    int isrMode[SHIM_PINS] = {};
+    std::vector<PinChange> changes;
+};
+
+inline State &state() {
+    static State state;
+    return state;
+}
+
+}
+
+inline unsigned long micros() {
+    auto elapsed = std::chrono::steady_clock::now() - shim::state().start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count() + shim::state().skipped;
+}
+
+inline unsigned long millis() {
+    return micros() / 1000;
+}
+
+inline void delay(unsigned long ms) {
+    shim::state().skipped += ms * 1000;
+}
+
+inline void delayMicroseconds(unsigned int us) {
+    shim::state().skipped += us;
+}
+
+inline void yield() {}
+
+inline void pinMode(uint8_t pin, uint8_t mode) {
+    shim::state().mode[pin] = mode;
+    if(mode == INPUT_PULLUP) {
+        shim::state().level[pin] = HIGH;
+    }
+}
+
+inline void digitalWrite(uint8_t pin, uint8_t level) {
+    level = level ? HIGH : LOW;
+    if(shim::state().level[pin] != level) {
+        shim::state().level[pin] = level;
+        shim::state().changes.push_back({ pin, level, micros() });
+    }
+}
+
+inline int digitalRead(uint8_t pin) {
+    return shim::state().level[pin];
+}
+
+inline int analogRead(uint8_t) {
+    return shim::state().analog;
+}
+
+inline int digitalPinToInterrupt(uint8_t pin) {
+    return pin;
+}
+
+inline void attachInterrupt(uint8_t pin, void (*isr)(void), int mode) {
+    shim::state().isr[pin] = isr;
+    shim::state().isrMode[pin] = mode;
+}
+
+inline void detachInterrupt(uint8_t pin) {
+    shim::state().isr[pin] = nullptr;
+}
+
+inline void noInterrupts() {}
+inline void interrupts() {}
+
+namespace shim {
+
+// Drives an input pin from the test, runs the attached interrupt handler like the GPIO would
+inline void setInput(uint8_t pin, uint8_t level) {
+    uint8_t previous = state().level[pin];
+    state().level[pin] = level;
+
+    int mode = state().isrMode[pin];
+    bool fire = previous != level && (mode == CHANGE || (mode == RISING && level == HIGH) || (mode == FALLING && level == LOW));
+    if(fire && state().isr[pin]) {
+        state().isr[pin]();
+    }
+}
+
+}
+
+class String {
+    public:
+        String() {}
+        String(const char *value) : _value(value ? value : "") {}
+        String(const std::string &value) : _value(value) {}
+        explicit String(char value) : _value(1, value) {}
+        explicit String(unsigned char value, unsigned char base = DEC) : String((unsigned long)value, base) {}
+        explicit String(int value, unsigned char base = DEC) : String((long)value, base) {}
+        explicit String(unsigned int value, unsigned char base = DEC) : String((unsigned long)value, base) {}
+        explicit String(long value, unsigned char base = DEC) {
+            if(value < 0 && base == DEC) {
+                _value = "-" + format((unsigned long)-value, base);
+            } else {
+                _value = format((unsigned long)value, base);
+            }
+        }
+        explicit String(unsigned long value, unsigned char base = DEC) : _value(format(value, base)) {}
+        explicit String(float value, unsigned char decimals = 2) : String((double)value, decimals) {}
+        explicit String(double value, unsigned char decimals = 2) {
+            char buffer[64];
+            snprintf(buffer, sizeof(buffer), "%.*f", decimals, value);
+            _value = buffer;
+        }
+
+        const char *c_str() const { return _value.c_str(); }
+        unsigned int length() const { return _value.length(); }
+        bool reserve(unsigned int size) { _value.reserve(size); return true; }
+
+        bool concat(const String &value) { _value += value._value; return true; }
+        bool concat(const char *value) { if(value) _value += value; return value != nullptr; }
+        bool concat(char value) { _value += value; return true; }
+
+        String &operator+=(const String &value) { concat(value); return *this; }
+        String &operator+=(const char *value) { concat(value); return *this; }
+        String &operator+=(char value) { concat(value); return *this; }
+        String &operator+=(unsigned char value) { return *this += String(value); }
+        String &operator+=(int value) { return *this += String(value); }
+        String &operator+=(unsigned int value) { return *this += String(value); }
+        String &operator+=(long value) { return *this += String(value); }
+        String &operator+=(unsigned long value) { return *this += String(value); }
+        String &operator+=(float value) { return *this += String(value); }
+        String &operator+=(double value) { return *this += String(value); }
+
+        bool equals(const String &value) const { return _value == value._value; }
+        bool operator==(const String &value) const { return _value == value._value; }
+        bool operator==(const char *value) const { return _value == (value ? value : ""); }
+        bool operator!=(const String &value) const { return !(*this == value); }
+        bool operator!=(const char *value) const { return !(*this == value); }
+        bool operator<(const String &value) const { return _value < value._value; }
+        char operator[](unsigned int index) const { return index < _value.size() ? _value[index] : 0; }
+        char charAt(unsigned int index) const { return (*this)[index]; }
+
+        bool startsWith(const String &prefix) const { return _value.compare(0, prefix._value.size(), prefix._value) == 0; }
+        bool endsWith(const String &suffix) const {
+            return _value.size() >= suffix._value.size() && _value.compare(_value.size() - suffix._value.size(), suffix._value.size(), suffix._value) == 0;
+        }
+        int indexOf(char value, unsigned int from = 0) const { return position(_value.find(value, from)); }
+        int indexOf(const String &value, unsigned int from = 0) const { return position(_value.find(value._value, from)); }
+        int lastIndexOf(char value) const { return position(_value.rfind(value)); }
+        String substring(unsigned int from) const { return from < _value.size() ? String(_value.substr(from)) : String(); }
+        String substring(unsigned int from, unsigned int to) const {
+            if(from > to) {
+                unsigned int swap = from; from = to; to = swap;
+            }
+            return from < _value.size() ? String(_value.substr(from, to - from)) : String();
+        }
+
+        void replace(const String &find, const String &replacement) {
+            if(find._value.empty()) {
+                return;
+            }
+            for(size_t at = _value.find(find._value); at != std::string::npos; at = _value.find(find._value, at + replacement._value.size())) {
+                _value.replace(at, find._value.size(), replacement._value);
+            }
+        }
+        void trim() {
+            size_t begin = _value.find_first_not_of(" \t\r\n");
+            size_t end = _value.find_last_not_of(" \t\r\n");
+            _value = (begin == std::string::npos ? "" : _value.substr(begin, end - begin + 1));
+        }
+        void toLowerCase() { for(char &c : _value) c = tolower(c); }
+        void toUpperCase() { for(char &c : _value) c = toupper(c); }
+        long toInt() const { return atol(_value.c_str()); }
+        float toFloat() const { return atof(_value.c_str()); }
+    private:
+        std::string _value;
+
+        static std::string format(unsigned long value, unsigned char base) {
+            const char *digits = "0123456789abcdef";
+            std::string result;
+            do {
+                result.insert(result.begin(), digits[value % base]);
+                value /= base;
+            } while(value > 0);
+            return result;
+        }
+        static int position(size_t at) { return at == std::string::npos ? -1 : (int)at; }
+};
+
+// Result type of String concatenation in the Arduino core, ArduinoJson refers to it
+class StringSumHelper : public String {
+    public:
+        using String::String;
+        StringSumHelper(const String &value) : String(value) {}
+};
+
+inline StringSumHelper operator+(const String &left, const String &right) { StringSumHelper result(left); result += right; return result; }
+inline StringSumHelper operator+(const String &left, const char *right) { StringSumHelper result(left); result += right; return result; }
+inline StringSumHelper operator+(const char *left, const String &right) { StringSumHelper result(left); result += right; return result; }
+inline StringSumHelper operator+(const String &left, char right) { StringSumHelper result(left); result += right; return result; }
+inline StringSumHelper operator+(const String &left, unsigned char right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, int right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, unsigned int right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, long right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, unsigned long right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, float right) { return left + String(right); }
+inline StringSumHelper operator+(const String &left, double right) { return left + String(right); }
+
+class Print {
+    public:
+        virtual ~Print() {}
+        virtual size_t write(uint8_t c) = 0;
+        virtual size_t write(const uint8_t *buffer, size_t size) {
+            size_t written = 0;
+            while(size-- > 0) {
+                written += write(*buffer++);
+            }
+            return written;
+        }
+        size_t write(const char *text) { return text ? write((const uint8_t *)text, strlen(text)) : 0; }
+        size_t write(const char *buffer, size_t size) { return write((const uint8_t *)buffer, size); }
+        virtual void flush() {}
+
+        size_t print(const String &value) { return write(value.c_str()); }
+        size_t print(const char *value) { return write(value); }
+        size_t print(char value) { return write((uint8_t)value); }
+        template<typename T> size_t print(T value) { return print(String(value)); }
+        template<typename T> size_t print(T value, int format) { return print(String(value, format)); }
+        size_t println() { return write("\r\n"); }
+        template<typename T> size_t println(T value) { return print(value) + println(); }
+        size_t printf(const char *format, ...) __attribute__((format(printf, 2, 3))) {
+            char buffer[256];
+            va_list arguments;
+            va_start(arguments, format);
+            int length = vsnprintf(buffer, sizeof(buffer), format, arguments);
+            va_end(arguments);
+            return write((const uint8_t *)buffer, length < (int)sizeof(buffer) ? length : sizeof(buffer) - 1);
+        }
+};
+
+class Stream : public Print {
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+        size_t readBytes(char *buffer, size_t length) {
+            size_t count = 0;
+            int c;
+            while(count < length && (c = read()) >= 0) {
+                buffer[count++] = (char)c;
+            }
+            return count;
+        }
+        size_t readBytes(uint8_t *buffer, size_t length) { return readBytes((char *)buffer, length); }
+};
+
+// Console output goes to stdout
+class HardwareSerial : public Stream {
+    public:
+        void begin(unsigned long) {}
+        size_t write(uint8_t c) override { return fwrite(&c, 1, 1, stdout); }
+        using Print::write;
+        int available() override { return 0; }
+        int read() override { return -1; }
+        int peek() override { return -1; }
+};
+
+inline HardwareSerial Serial;
+
+class EspClass {
+    public:
+        uint32_t getChipId() { return 0x00c0ffee; }
+        uint32_t getCycleCount() { return (uint32_t)microsecondsToClockCycles(micros()); }
+        uint32_t random() { return (uint32_t)rand(); }
+        uint32_t getFreeHeap() { return 40000; }
+        uint32_t getMaxFreeBlockSize() { return 30000; }
+        String getResetReason() { return "Power On"; }
+        void restart() {}
+        void reset() {}
+};
+
+inline EspClass ESP;
@@ -0,0 +1,42 @@
+// Wi-Fi shim for the native environment, always connected
+#pragma once
+
+#include <Arduino.h>
+
+#define WL_CONNECTED 3
+
+enum WiFiSleepType_t {
+    WIFI_NONE_SLEEP = 0,
+    WIFI_LIGHT_SLEEP = 1,
+    WIFI_MODEM_SLEEP = 2
+};
+
+class IPAddress {
+    public:
+        String toString() const { return "127.0.0.1"; }
+};
+
+class WiFiClass {
+    public:
+        int status() { return WL_CONNECTED; }
+        IPAddress localIP() { return IPAddress(); }
+        IPAddress softAPIP() { return IPAddress(); }
+        int32_t RSSI() { return -60; }
+        bool setSleepMode(WiFiSleepType_t type, uint8_t = 0) { _sleep = type; return true; }
+        WiFiSleepType_t getSleepMode() { return _sleep; }
+    private:
+        WiFiSleepType_t _sleep = WIFI_NONE_SLEEP;
+};
+
+inline WiFiClass WiFi;
+
+class Client : public Stream {
+    public:
+        size_t write(uint8_t) override { return 1; }
+        using Print::write;
+        int available() override { return 0; }
+        int read() override { return -1; }
+        int peek() override { return -1; }
+};
+
+class WiFiClient : public Client {};
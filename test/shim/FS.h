@@ -0,0 +1,71 @@
+// In-memory SPIFFS for the native environment, files live until the process ends
+#pragma once
+
+#include <Arduino.h>
+#include <map>
+#include <memory>
+
+namespace fs {
+
+class File : public Stream {
+    public:
+        File() {}
+        File(std::shared_ptr<std::string> content, bool writing) : _content(content), _writing(writing) {}
+
+        operator bool() const { return (bool)_content; }
+        size_t size() const { return _content ? _content->size() : 0; }
+        void close() { _content.reset(); }
+
+        size_t write(uint8_t c) override {
+            if(!_content || !_writing) {
+                return 0;
+            }
+            _content->push_back((char)c);
+            return 1;
+        }
+        using Print::write;
+
+        int available() override { return _content ? (int)(_content->size() - _position) : 0; }
+        int read() override { return available() > 0 ? (unsigned char)(*_content)[_position++] : -1; }
+        int peek() override { return available() > 0 ? (unsigned char)(*_content)[_position] : -1; }
+    private:
+        std::shared_ptr<std::string> _content;
+        bool _writing = false;
+        size_t _position = 0;
+};
+
+class FS {
+    public:
+        bool begin() { return true; }
+        bool format() { _files.clear(); return true; }
+        bool exists(const String &path) { return _files.count(path.c_str()) > 0; }
+        bool remove(const String &path) { return _files.erase(path.c_str()) > 0; }
+        bool rename(const String &from, const String &to) {
+            if(!exists(from) || exists(to)) {
+                return false;
+            }
+            _files[to.c_str()] = _files[from.c_str()];
+            _files.erase(from.c_str());
+            return true;
+        }
+        File open(const String &path, const char *mode) {
+            bool writing = (mode[0] == 'w' || mode[0] == 'a');
+            if(!writing && !exists(path)) {
+                return File();
+            }
+
+            std::shared_ptr<std::string> &content = _files[path.c_str()];
+            if(!content || mode[0] == 'w') {
+                content = std::make_shared<std::string>();
+            }
+            return File(content, writing);
+        }
+    private:
+        std::map<std::string, std::shared_ptr<std::string>> _files;
+};
+
+}
+
+using fs::File;
+
+inline fs::FS SPIFFS;
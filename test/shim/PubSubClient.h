@@ -0,0 +1,96 @@
+// MQTT broker stand-in for the native environment. Replaces the client library: messages
+// published by the firmware are recorded with their time, messages injected by a test are
+// queued and delivered from loop(), one per call like the real client reads one packet.
+// A full queue drops the message, as a broker does for a QoS 0 subscriber which falls behind.
+#pragma once
+
+#include <ESP8266WiFi.h>
+#include <deque>
+
+#define MQTT_CONNECTED 0
+#define MQTT_DISCONNECTED -1
+
+class PubSubClient {
+    public:
+        typedef std::function<void(char *, uint8_t *, unsigned int)> callback_t;
+
+        struct Message {
+            std::string topic;
+            std::string payload;
+            bool retained;
+            unsigned long time; // micros() when published / injected
+        };
+
+        PubSubClient(Client &) { instance() = this; }
+
+        // The client the firmware created, for the test side
+        static PubSubClient *&instance() {
+            static PubSubClient *client = nullptr;
+            return client;
+        }
+
+        PubSubClient &setServer(const char *, uint16_t) { return *this; }
+        PubSubClient &setCallback(callback_t callback) { _callback = callback; return *this; }
+
+        bool connect(const char *, const char *, const char *, const char *willTopic, uint8_t, bool willRetain, const char *willMessage) {
+            _will = { willTopic, willMessage, willRetain, 0 };
+            _connected = true;
+            connections++;
+            return true;
+        }
+        void disconnect() { _connected = false; }
+        bool connected() { return _connected; }
+        int state() { return _connected ? MQTT_CONNECTED : MQTT_DISCONNECTED; }
+
+        bool publish(const char *topic, const char *payload, bool retained = false) {
+            if(!_connected) {
+                return false;
+            }
+            published.push_back({ topic, payload, retained, micros() });
+            return true;
+        }
+
+        bool subscribe(const char *topic) {
+            subscriptions.push_back(topic);
+            return _connected;
+        }
+
+        bool loop() {
+            if(!_connected) {
+                return false;
+            }
+
+            if(!inbox.empty() && _callback) {
+                Message message = inbox.front();
+                inbox.pop_front();
+                delivered++;
+
+                // Library passes the topic as C string and the payload without terminator
+                std::vector<uint8_t> payload(message.payload.begin(), message.payload.end());
+                _callback(&message.topic[0], payload.data(), payload.size());
+            }
+            return true;
+        }
+
+        // Test side: publishes a message to the firmware, false when it was dropped
+        bool inject(const std::string &topic, const std::string &payload) {
+            if(inbox.size() >= inboxCapacity) {
+                dropped++;
+                return false;
+            }
+            inbox.push_back({ topic, payload, false, micros() });
+            return true;
+        }
+
+        std::deque<Message> inbox;
+        size_t inboxCapacity = 16;
+        unsigned long delivered = 0;
+        unsigned long dropped = 0;
+        unsigned long connections = 0;
+        std::vector<Message> published;
+        std::vector<std::string> subscriptions;
+    private:
+        callback_t _callback;
+        bool _connected = false;
+        Message _will;
+};
@@ -0,0 +1,11 @@
+// Ticker shim for the native environment, status LED blinking is not simulated
+#pragma once
+
+#include <Arduino.h>
+
+class Ticker {
+    public:
+        void attach(float, void (*)()) {}
+        void attach_ms(uint32_t, void (*)()) {}
+        void detach() {}
+};
@@ -0,0 +1,12 @@
+// WiFiManager shim for the native environment, connects right away
+#pragma once
+
+#include <ESP8266WiFi.h>
+
+class WiFiManager {
+    public:
+        void setConfigPortalTimeout(unsigned long) {}
+        void setAPCallback(void (*)(WiFiManager *)) {}
+        bool autoConnect(const char *) { return true; }
+        String getConfigPortalSSID() { return ""; }
+};
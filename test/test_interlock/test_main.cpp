@@ -0,0 +1,122 @@
+// Interlock decisions from simulated sensor readings
+#include <unity.h>
+#include "Interlock.h"
+
+Interlock sensor;
+
+void setUp() {
+    sensor = Interlock();
+}
+
+void tearDown() {}
+
+void test_first_reading_is_taken_without_settling() {
+    sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 1000);
+
+    TEST_ASSERT_TRUE(sensor.update(0, 0));
+    TEST_ASSERT_TRUE(sensor.isActive());
+    TEST_ASSERT_EQUAL_STRING("rain", sensor.reason());
+}
+
+void test_switch_settles_before_change() {
+    sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 1000);
+    sensor.update(1, 0);
+    TEST_ASSERT_FALSE(sensor.isActive());
+
+    // Short spike is ignored
+    TEST_ASSERT_FALSE(sensor.update(0, 100));
+    TEST_ASSERT_FALSE(sensor.update(1, 200));
+    TEST_ASSERT_FALSE(sensor.update(0, 1150));
+    TEST_ASSERT_FALSE(sensor.isActive());
+
+    // Closed for the whole settle time
+    TEST_ASSERT_FALSE(sensor.update(0, 2000));
+    TEST_ASSERT_TRUE(sensor.update(0, 2150));
+    TEST_ASSERT_TRUE(sensor.isActive());
+}
+
+void test_switch_release_settles() {
+    sensor.configure(INTERLOCK_SWITCH, false, 0, 0, 500);
+    sensor.update(1, 0);
+    TEST_ASSERT_TRUE(sensor.isActive());
+
+    TEST_ASSERT_FALSE(sensor.update(0, 100));
+    TEST_ASSERT_TRUE(sensor.isActive());
+    TEST_ASSERT_TRUE(sensor.update(0, 600));
+    TEST_ASSERT_FALSE(sensor.isActive());
+    TEST_ASSERT_NULL(sensor.reason());
+}
+
+void test_analog_hysteresis() {
+    // Dry soil reads high, inhibit when wet (below 400), release above 450
+    sensor.configure(INTERLOCK_ANALOG, true, 400, 50, 0);
+    sensor.update(600, 0);
+    TEST_ASSERT_FALSE(sensor.isActive());
+
+    TEST_ASSERT_FALSE(sensor.update(401, 10));
+    TEST_ASSERT_TRUE(sensor.update(400, 20));
+    TEST_ASSERT_EQUAL_STRING("soil", sensor.reason());
+
+    // Inside the band the state holds
+    TEST_ASSERT_FALSE(sensor.update(420, 30));
+    TEST_ASSERT_FALSE(sensor.update(450, 40));
+    TEST_ASSERT_TRUE(sensor.isActive());
+
+    TEST_ASSERT_TRUE(sensor.update(451, 50));
+    TEST_ASSERT_FALSE(sensor.isActive());
+}
+
+void test_analog_active_high_hysteresis() {
+    sensor.configure(INTERLOCK_ANALOG, false, 700, 100, 0);
+    sensor.update(100, 0);
+
+    TEST_ASSERT_TRUE(sensor.update(700, 10));
+    TEST_ASSERT_FALSE(sensor.update(601, 20));
+    TEST_ASSERT_TRUE(sensor.isActive());
+    TEST_ASSERT_TRUE(sensor.update(599, 30));
+    TEST_ASSERT_FALSE(sensor.isActive());
+}
+
+void test_settle_time_survives_counter_overflow() {
+    sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 1000);
+    sensor.update(1, 0xFFFFFF00);
+
+    TEST_ASSERT_FALSE(sensor.update(0, 0xFFFFFF80));
+    TEST_ASSERT_FALSE(sensor.update(0, 0x00000100));
+    TEST_ASSERT_TRUE(sensor.update(0, 0x00000400));
+}
+
+void test_unchanged_configure_keeps_state() {
+    sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 1000);
+    sensor.update(0, 0);
+
+    TEST_ASSERT_FALSE(sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 1000));
+    TEST_ASSERT_TRUE(sensor.isActive());
+
+    // Changed settings start over with the next reading
+    TEST_ASSERT_TRUE(sensor.configure(INTERLOCK_SWITCH, true, 0, 0, 2000));
+    TEST_ASSERT_FALSE(sensor.isActive());
+    TEST_ASSERT_FALSE(sensor.update(1, 10));
+    TEST_ASSERT_FALSE(sensor.isActive());
+}
+
+void test_disabled_never_inhibits() {
+    sensor.configure(INTERLOCK_NONE, true, 0, 0, 0);
+
+    TEST_ASSERT_FALSE(sensor.update(0, 0));
+    TEST_ASSERT_FALSE(sensor.update(0, 5000));
+    TEST_ASSERT_FALSE(sensor.isActive());
+}
+
+int main(int argc, char **argv) {
+    UNITY_BEGIN();
+    RUN_TEST(test_first_reading_is_taken_without_settling);
+    RUN_TEST(test_switch_settles_before_change);
+    RUN_TEST(test_switch_release_settles);
+    RUN_TEST(test_analog_hysteresis);
+    RUN_TEST(test_analog_active_high_hysteresis);
+    RUN_TEST(test_settle_time_survives_counter_overflow);
+    RUN_TEST(test_unchanged_configure_keeps_state);
+    RUN_TEST(test_disabled_never_inhibits);
+    return UNITY_END();
+}
@@ -0,0 +1,225 @@
+// MQTT command path under load: the firmware runs on the native shim against the broker
+// stand-in, commands are flooded at a given rate and the time from publish to the relay
+// GPIO change and to the state echo is measured, together with drop and duplicate counts.
+// Latency in loop() passes is deterministic, microseconds depend on the host.
+#include <Arduino.h>
+#include <PubSubClient.h>
+#include <unity.h>
+#include <deque>
+#include "settings.h"
+#include "pins.h"
+
+// Firmware
+extern Configuration Config;
+void setup();
+void loop();
+void reconnectMqtt();
+
+struct RunResult {
+    unsigned long injected;
+    unsigned long dropped;     // refused by the full broker queue
+    unsigned long switches;    // commands which should have switched a relay
+    unsigned long applied;     // relay GPIO changes
+    unsigned long echoes;      // state messages published back
+    unsigned long duplicates;  // GPIO changes or echoes without a command
+    unsigned long passes;
+    unsigned long passesMax;   // publish to GPIO change
+    unsigned long gpioTimeMax; // us, publish to GPIO change
+    unsigned long gpioTimeTotal;
+    unsigned long echoTimeMax; // us, publish to state echo
+    unsigned long echoTimeTotal;
+};
+
+PubSubClient *broker;
+unsigned long passes;
+
+String commandTopic(int relay) {
+    return Config.mqtt_channel_prefix + (relay + 1) + "command/power";
+}
+
+String stateTopic(int relay) {
+    return Config.mqtt_channel_prefix + (relay + 1) + "/state";
+}
+
+void runLoop() {
+    loop();
+    passes++;
+}
+
+// Drains the broker queue and forgets all recorded traffic
+void drain() {
+    while(!broker->inbox.empty()) {
+        runLoop();
+    }
+    runLoop();
+
+    broker->published.clear();
+    shim::state().changes.clear();
+}
+
+// Floods both relays with alternating commands, perPass messages are published before every loop() pass
+RunResult flood(unsigned long commands, unsigned int perPass, bool repeat = false) {
+    RunResult result = {};
+
+    struct Pending {
+        unsigned long time;
+        unsigned long pass;
+    };
+    std::deque<Pending> pending[RELAYS_COUNT];
+    bool expected[RELAYS_COUNT] = {};
+
+    size_t gpioSeen = 0;
+    size_t publishedSeen = 0;
+    unsigned long start = passes;
+
+    auto collect = [&]() {
+        // Relay GPIO changes matched with the commands in order
+        auto &changes = shim::state().changes;
+        for(; gpioSeen < changes.size(); gpioSeen++) {
+            for(int r = 0; r < RELAYS_COUNT; r++) {
+                if(changes[gpioSeen].pin != RELAY_PINS[r]) {
+                    continue;
+                }
+
+                result.applied++;
+                if(pending[r].empty()) {
+                    result.duplicates++;
+                    continue;
+                }
+
+                unsigned long time = changes[gpioSeen].time - pending[r].front().time;
+                result.gpioTimeTotal += time;
+                result.gpioTimeMax = max(result.gpioTimeMax, time);
+                result.passesMax = max(result.passesMax, passes - pending[r].front().pass);
+            }
+        }
+
+        // State echoes, each one closes the oldest command of the relay
+        for(; publishedSeen < broker->published.size(); publishedSeen++) {
+            PubSubClient::Message &message = broker->published[publishedSeen];
+            for(int r = 0; r < RELAYS_COUNT; r++) {
+                if(message.topic != stateTopic(r).c_str()) {
+                    continue;
+                }
+
+                result.echoes++;
+                if(pending[r].empty()) {
+                    result.duplicates++;
+                    continue;
+                }
+
+                unsigned long time = message.time - pending[r].front().time;
+                result.echoTimeTotal += time;
+                result.echoTimeMax = max(result.echoTimeMax, time);
+                pending[r].pop_front();
+            }
+        }
+    };
+
+    for(unsigned long sent = 0; sent < commands || !broker->inbox.empty();) {
+        for(unsigned int i = 0; i < perPass && sent < commands; i++, sent++) {
+            int relay = sent % RELAYS_COUNT;
+            bool state = repeat || !expected[relay];
+
+            result.injected++;
+            if(!broker->inject(commandTopic(relay).c_str(), state ? "ON" : "OFF")) {
+                continue;
+            }
+
+            // Queue is delivered in order, so the effect of the command is known already
+            if(state != expected[relay]) {
+                expected[relay] = state;
+                pending[relay].push_back({ micros(), passes });
+                result.switches++;
+            }
+        }
+
+        runLoop();
+        collect();
+    }
+
+    result.dropped = broker->dropped;
+    broker->dropped = 0;
+    result.passes = passes - start;
+
+    printf("[MQTT LOAD] %lu commands at %u per pass: dropped %lu, switched %lu of %lu, echoes %lu, duplicates %lu, "
+        "publish to GPIO max %lu passes / avg %lu us / max %lu us, publish to echo avg %lu us / max %lu us\n",
+        result.injected, perPass, result.dropped, result.applied, result.switches, result.echoes, result.duplicates,
+        result.passesMax, result.applied > 0 ? result.gpioTimeTotal / result.applied : 0, result.gpioTimeMax,
+        result.echoes > 0 ? result.echoTimeTotal / result.echoes : 0, result.echoTimeMax);
+
+    return result;
+}
+
+void setUp() {
+    broker->inbox.clear();
+    for(int r = 0; r < RELAYS_COUNT; r++) {
+        broker->inject(commandTopic(r).c_str(), "OFF");
+    }
+    drain();
+}
+
+void tearDown() {}
+
+void test_subscribes_to_command_topics() {
+    TEST_ASSERT_EQUAL(RELAYS_COUNT, broker->subscriptions.size());
+    for(int r = 0; r < RELAYS_COUNT; r++) {
+        TEST_ASSERT_EQUAL_STRING(commandTopic(r).c_str(), broker->subscriptions[r].c_str());
+    }
+}
+
+void test_command_switches_relay_in_one_pass() {
+    RunResult result = flood(1, 1);
+
+    TEST_ASSERT_EQUAL(1, result.applied);
+    TEST_ASSERT_EQUAL(1, result.echoes);
+    TEST_ASSERT_EQUAL(1, result.passesMax);
+    TEST_ASSERT_EQUAL(LOW, digitalRead(RELAY_PINS[0]));
+    TEST_ASSERT_EQUAL_STRING("1", broker->published.back().payload.c_str());
+}
+
+void test_repeated_command_is_not_duplicated() {
+    RunResult result = flood(20, 1, true);
+
+    TEST_ASSERT_EQUAL(RELAYS_COUNT, result.applied);
+    TEST_ASSERT_EQUAL(RELAYS_COUNT, result.echoes);
+    TEST_ASSERT_EQUAL(0, result.duplicates);
+}
+
+void test_flood_at_loop_rate() {
+    RunResult result = flood(1000, 1);
+
+    TEST_ASSERT_EQUAL(0, result.dropped);
+    TEST_ASSERT_EQUAL(result.switches, result.applied);
+    TEST_ASSERT_EQUAL(result.switches, result.echoes);
+    TEST_ASSERT_EQUAL(0, result.duplicates);
+    TEST_ASSERT_EQUAL(1, result.passesMax);
+}
+
+void test_flood_above_loop_rate() {
+    RunResult result = flood(1000, 4);
+
+    // One message per pass is taken, the rest waits in the queue or is dropped when it is full
+    TEST_ASSERT_TRUE(result.dropped > 0);
+    TEST_ASSERT_EQUAL(result.switches, result.applied);
+    TEST_ASSERT_EQUAL(result.switches, result.echoes);
+    TEST_ASSERT_EQUAL(0, result.duplicates);
+    TEST_ASSERT_TRUE(result.passesMax <= broker->inboxCapacity);
+}
+
+int main(int argc, char **argv) {
+    setup();
+
+    Config.mqtt_server = "localhost";
+    Config.mqtt_channel_prefix = "irrigation/";
+    reconnectMqtt();
+    broker = PubSubClient::instance();
+
+    UNITY_BEGIN();
+    RUN_TEST(test_subscribes_to_command_topics);
+    RUN_TEST(test_command_switches_relay_in_one_pass);
+    RUN_TEST(test_repeated_command_is_not_duplicated);
+    RUN_TEST(test_flood_at_loop_rate);
+    RUN_TEST(test_flood_above_loop_rate);
+    return UNITY_END();
+}